@@ -0,0 +1,177 @@
+/** -*-c++-*-
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ *  File: BinaryIO.hpp
+ *  Project: lambdaminer (potential ICFP 2012 contest entry)
+ *  Date: 2012-07-16
+ *
+ *  Plain binary files of fixed-size values, written in one go and read
+ *  back through a memory mapping.
+ *
+ */
+
+#ifndef LAMBDAMINER_BINARYIO_HPP
+#define LAMBDAMINER_BINARYIO_HPP 1
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::size_t;
+
+// Values are stored as they are laid out in memory, so files can move
+// between machines of the same byte order only.
+//
+// The file is written under a temporary name and only takes the place of
+// the given one once complete, so a crash while writing leaves any
+// earlier file of that name as it was.
+
+class BinaryWriter
+{
+public:
+    explicit BinaryWriter(std::string const& path)
+        : path_(path),
+          temporary_(path + ".tmp"),
+          output_(temporary_.c_str(), std::ios::out | std::ios::binary)
+    {
+    }
+
+    template<typename T>
+    void put(T const& value)
+    {
+        put_bytes(&value, sizeof(T));
+    }
+
+    void put_bytes(void const* const data, size_t const n)
+    {
+        output_.write(static_cast<char const*>(data), n);
+    }
+
+    // Finishes the file and moves it into place. Returns false if
+    // anything went wrong along the way.
+    bool commit()
+    {
+        output_.close();
+        if (output_.fail())
+        {
+            std::remove(temporary_.c_str());
+            return false;
+        }
+        return std::rename(temporary_.c_str(), path_.c_str()) == 0;
+    }
+
+private:
+    std::string path_, temporary_;
+    std::ofstream output_;
+
+    BinaryWriter(BinaryWriter const&);
+    BinaryWriter& operator=(BinaryWriter const&);
+};
+
+// Reads values in the order they were written. Reading past the end of
+// the file throws, so a truncated file is caught before it does harm. So
+// does a count of items that cannot all fit into the rest of the file,
+// before anything is allocated for them.
+
+class BinaryReader
+{
+public:
+    BinaryReader()
+        : data_(0),
+          size_(0),
+          position_(0)
+    {
+    }
+
+    ~BinaryReader()
+    {
+        close();
+    }
+
+    // Maps the file at the given path into memory. Returns false if it
+    // cannot be opened or mapped.
+    bool open(char const* const path)
+    {
+        close();
+
+        int const fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        if (::fstat(fd, &info) == 0 and S_ISREG(info.st_mode)
+            and info.st_size > 0)
+        {
+            void* const p = ::mmap(0, info.st_size, PROT_READ, MAP_PRIVATE,
+                                   fd, 0);
+            if (p != MAP_FAILED)
+            {
+                data_ = static_cast<char const*>(p);
+                size_ = info.st_size;
+                ::madvise(p, size_, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+
+        return data_ != 0;
+    }
+
+    void close()
+    {
+        if (data_ != 0)
+            ::munmap(const_cast<char*>(data_), size_);
+        data_ = 0;
+        size_ = position_ = 0;
+    }
+
+    template<typename T>
+    T get()
+    {
+        T value;
+        std::memcpy(&value, bytes(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    // Reads a count stored as a T, for items that take at least the given
+    // number of bytes each in the rest of the file.
+    template<typename T>
+    size_t count(size_t const each)
+    {
+        T const n = get<T>();
+        if (each > 0 and n > remaining() / each)
+            throw "Unexpected end of file.";
+        return n;
+    }
+
+    // The next n bytes of the file, which stay valid until it is closed.
+    char const* bytes(size_t const n)
+    {
+        if (n > size_ - position_)
+            throw "Unexpected end of file.";
+
+        char const* const p = data_ + position_;
+        position_ += n;
+        return p;
+    }
+
+    size_t remaining() const { return size_ - position_; }
+
+    bool at_end() const { return position_ == size_; }
+
+private:
+    char const* data_;
+    size_t size_;
+    size_t position_;
+
+    BinaryReader(BinaryReader const&);
+    BinaryReader& operator=(BinaryReader const&);
+};
+
+#endif
@@ -0,0 +1,135 @@
+/** -*-c++-*-
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ *  File: BucketQueue.hpp
+ *  Project: lambdaminer (potential ICFP 2012 contest entry)
+ *  Date: 2012-07-16
+ *
+ *  A priority queue for small integer priorities, with a bucket for each
+ *  priority between the lowest and the highest one seen.
+ *
+ */
+
+#ifndef LAMBDAMINER_BUCKETQUEUE_HPP
+#define LAMBDAMINER_BUCKETQUEUE_HPP 1
+
+#include <algorithm>
+#include <vector>
+
+using std::size_t;
+
+// Items with the highest priority come out first, and among those the
+// one pushed last. Pushing takes constant time, and so does popping,
+// apart from skipping buckets that have run empty.
+
+template<typename T>
+class BucketQueue
+{
+public:
+    BucketQueue()
+        : low_(0),
+          top_(0),
+          size_(0)
+    {
+    }
+
+    bool empty() const { return size_ == 0; }
+
+    size_t size() const { return size_; }
+
+    int top_priority() const { return low_ + int(top_); }
+
+    T const& top() const { return buckets_.at(top_).back(); }
+
+    void push(int const priority, T const& item)
+    {
+        if (buckets_.empty())
+            low_ = priority;
+        else if (priority < low_)
+        {
+            buckets_.insert(buckets_.begin(), low_ - priority,
+                            std::vector<T>());
+            top_ += low_ - priority;
+            low_ = priority;
+        }
+
+        size_t const i = priority - low_;
+        if (i >= buckets_.size())
+            buckets_.resize(i + 1);
+
+        buckets_.at(i).push_back(item);
+        if (size_ == 0 or i > top_)
+            top_ = i;
+        ++size_;
+    }
+
+    void pop()
+    {
+        buckets_.at(top_).pop_back();
+        --size_;
+
+        while (size_ > 0 and buckets_.at(top_).empty())
+            --top_;
+    }
+
+    size_t bytes() const
+    {
+        size_t n = buckets_.capacity() * sizeof(std::vector<T>);
+        for (size_t i = 0; i < buckets_.size(); ++i)
+            n += buckets_.at(i).capacity() * sizeof(T);
+        return n;
+    }
+
+    // Drops items with the lowest priorities, oldest first, until at most
+    // n are left, and appends the items dropped to the given vector.
+    void truncate(size_t const n, std::vector<T>& dropped)
+    {
+        for (size_t i = 0; size_ > n; ++i)
+        {
+            std::vector<T>& bucket = buckets_.at(i);
+            size_t const k = std::min(bucket.size(), size_ - n);
+
+            dropped.insert(dropped.end(), bucket.begin(), bucket.begin() + k);
+            bucket.erase(bucket.begin(), bucket.begin() + k);
+            size_ -= k;
+        }
+    }
+
+    // Calls f(item) for every item in the queue, in no particular order.
+    template<typename F>
+    void visit(F& f) const
+    {
+        for (size_t i = 0; i < buckets_.size(); ++i)
+            for (size_t j = 0; j < buckets_.at(i).size(); ++j)
+                f(buckets_.at(i).at(j));
+    }
+
+    // As above, but f may change the items it is given.
+    template<typename F>
+    void visit(F& f)
+    {
+        for (size_t i = 0; i < buckets_.size(); ++i)
+            for (size_t j = 0; j < buckets_.at(i).size(); ++j)
+                f(buckets_.at(i).at(j));
+    }
+
+    // Calls f(priority, item) for every item in the queue, lowest priority
+    // first and in the order pushed within a priority, so that pushing
+    // the items in this order into an empty queue gives the same queue.
+    template<typename F>
+    void visit_in_order(F& f) const
+    {
+        for (size_t i = 0; i < buckets_.size(); ++i)
+            for (size_t j = 0; j < buckets_.at(i).size(); ++j)
+                f(low_ + int(i), buckets_.at(i).at(j));
+    }
+
+private:
+    std::vector<std::vector<T> > buckets_;
+    int low_;
+    size_t top_;
+    size_t size_;
+};
+
+#endif
@@ -0,0 +1,196 @@
+/** -*-c++-*-
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ *  File: Counters.hpp
+ *  Project: lambdaminer (potential ICFP 2012 contest entry)
+ *  Date: 2012-07-16
+ *
+ *  Counters and timers for finding out where the time goes, and a small
+ *  writer for reporting them as JSON.
+ *
+ */
+
+#ifndef LAMBDAMINER_COUNTERS_HPP
+#define LAMBDAMINER_COUNTERS_HPP 1
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include <sys/resource.h>
+
+using std::size_t;
+
+// A count that several threads may add to. The additions need no order,
+// since counts are only read once the work is done.
+
+class Counter
+{
+    std::atomic<std::uint64_t> n_;
+
+    Counter(Counter const&);
+    Counter& operator=(Counter const&);
+
+public:
+    Counter()
+        : n_(0)
+    {
+    }
+
+    void add(std::uint64_t const n = 1)
+    {
+        n_.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    std::uint64_t get() const
+    {
+        return n_.load(std::memory_order_relaxed);
+    }
+};
+
+// Splits the time spent in a stretch of code between counters of
+// nanoseconds: each call to lap() adds the time since the previous one,
+// or since the start, to the given counter, and skip() lets the time go
+// uncounted. A stopwatch that is not running does nothing, so it costs
+// next to nothing where no one is looking.
+
+class Stopwatch
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit Stopwatch(bool const running)
+        : running_(running),
+          last_(running ? Clock::now() : Clock::time_point())
+    {
+    }
+
+    void lap(Counter& total)
+    {
+        if (running_)
+        {
+            Clock::time_point const now = Clock::now();
+            total.add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          now - last_).count());
+            last_ = now;
+        }
+    }
+
+    void skip()
+    {
+        if (running_)
+            last_ = Clock::now();
+    }
+
+private:
+    bool running_;
+    Clock::time_point last_;
+};
+
+inline double seconds(std::uint64_t const nanoseconds)
+{
+    return nanoseconds * 1e-9;
+}
+
+inline double seconds_since(Stopwatch::Clock::time_point const start)
+{
+    return std::chrono::duration<double>(Stopwatch::Clock::now() - start)
+        .count();
+}
+
+// The ratio of two counts, or zero if there is nothing to divide by.
+
+inline double ratio(double const part, double const whole)
+{
+    return whole > 0 ? part / whole : 0;
+}
+
+// The largest resident set size of the process so far, in kilobytes.
+
+inline size_t peak_rss_kb()
+{
+    struct rusage usage;
+    return ::getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+}
+
+// Writes a JSON object to a stream, one member at a time, and closes it
+// when it goes out of scope. A member whose value is an object or array
+// is written by starting it with key() and then writing the value to the
+// stream, for instance through a nested Json.
+
+class Json
+{
+public:
+    explicit Json(std::ostream& output)
+        : output_(output),
+          first_(true)
+    {
+        output_ << '{';
+    }
+
+    ~Json()
+    {
+        output_ << '}';
+    }
+
+    std::ostream& key(std::string const& name)
+    {
+        if (not first_)
+            output_ << ',';
+        first_ = false;
+        quote(output_, name);
+        return output_ << ':';
+    }
+
+    template<typename T>
+    Json& member(std::string const& name, T const& value)
+    {
+        key(name) << value;
+        return *this;
+    }
+
+    Json& member(std::string const& name, std::string const& value)
+    {
+        quote(key(name), value);
+        return *this;
+    }
+
+    Json& member(std::string const& name, char const* value)
+    {
+        return member(name, std::string(value));
+    }
+
+    Json& member(std::string const& name, bool const value)
+    {
+        key(name) << (value ? "true" : "false");
+        return *this;
+    }
+
+    static void quote(std::ostream& output, std::string const& text)
+    {
+        output << '"';
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            char const c = text.at(i);
+            if (c == '"' or c == '\\')
+                output << '\\' << c;
+            else if (c == '\n')
+                output << "\\n";
+            else if ((unsigned char) c >= 0x20)
+                output << c;
+        }
+        output << '"';
+    }
+
+private:
+    std::ostream& output_;
+    bool first_;
+
+    Json(Json const&);
+    Json& operator=(Json const&);
+};
+
+#endif
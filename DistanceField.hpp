@@ -0,0 +1,500 @@
+/** -*-c++-*-
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ *  File: DistanceField.hpp
+ *  Project: lambdaminer (potential ICFP 2012 contest entry)
+ *  Date: 2012-07-16
+ *
+ *  Breadth-first distances on a grid to the nearest of a set of targets,
+ *  with updates for a few changed cells that only touch the part of the
+ *  field that depends on them. Fields are kept in square tiles that
+ *  copies share until they are written to, so a field made from another
+ *  by an update costs about as much as the tiles it changed.
+ *
+ */
+
+#ifndef LAMBDAMINER_DISTANCEFIELD_HPP
+#define LAMBDAMINER_DISTANCEFIELD_HPP 1
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <tr1/memory>
+
+using std::size_t;
+
+// Each cell is open, blocked or a target. Distances count steps between
+// horizontally or vertically adjacent cells that are not blocked.
+//
+// The cells are given by a function object, called as kind(x, y) for a
+// single cell and as kind(y, row) to fill in a whole row, so the field
+// need not keep a copy of the grid.
+
+class DistanceField
+{
+public:
+    typedef std::uint32_t Distance;
+    typedef std::uint32_t Cell;
+
+    typedef enum { OPEN, BLOCKED, TARGET } Kind;
+
+    static Distance const UNREACHABLE = ~Distance(0);
+
+    // A field with every cell unreachable, until computed.
+    DistanceField(size_t const width, size_t const height)
+        : width_(width),
+          height_(height),
+          columns_((width + TILE_SIZE - 1) >> TILE_BITS),
+          tiles_(columns_ * ((height + TILE_SIZE - 1) >> TILE_BITS),
+                 blank()),
+          mine_(tiles_.size(), false),
+          owned_(0)
+    {
+    }
+
+    // A copy shares all tiles with the original and makes its own copy of
+    // a tile only once it changes a cell in there.
+    DistanceField(DistanceField const& other)
+        : width_(other.width_),
+          height_(other.height_),
+          columns_(other.columns_),
+          tiles_(other.tiles_),
+          mine_(tiles_.size(), false),
+          owned_(0)
+    {
+    }
+
+    size_t width() const { return width_; }
+    size_t height() const { return height_; }
+
+    Distance at(size_t const x, size_t const y) const
+    {
+        if (x >= width_ or y >= height_)
+            return UNREACHABLE;
+        else
+            return get(x, y);
+    }
+
+    // The bytes this field holds on its own: the tiles it made, but not
+    // those it shares with the field it was copied from.
+    size_t bytes() const
+    {
+        return sizeof(DistanceField) + tiles_.capacity() * sizeof(TilePtr)
+            + mine_.capacity() / 8 + owned_ * sizeof(Tile);
+    }
+
+    bool operator==(DistanceField const& other) const
+    {
+        if (width_ != other.width_ or height_ != other.height_)
+            return false;
+
+        for (size_t y = 0; y < height_; ++y)
+            for (size_t x = 0; x < width_; ++x)
+                if (get(x, y) != other.get(x, y))
+                    return false;
+
+        return true;
+    }
+
+    // Computes the whole field from scratch.
+    template<typename Kinds>
+    void compute(Kinds const& kind)
+    {
+        std::vector<Kind> row(width_);
+        std::vector<bool> blocked(width_ * height_, false);
+        std::vector<Cell> open;
+
+        TilePtr const none = blank();
+        for (size_t t = 0; t < tiles_.size(); ++t)
+        {
+            tiles_[t] = none;
+            mine_[t] = false;
+        }
+        owned_ = 0;
+
+        for (size_t y = 0; y < height_; ++y)
+        {
+            kind(y, &row[0]);
+            for (size_t x = 0; x < width_; ++x)
+            {
+                if (row[x] == TARGET)
+                {
+                    put(x, y, 0);
+                    open.push_back(y * width_ + x);
+                }
+                else if (row[x] == BLOCKED)
+                    blocked[y * width_ + x] = true;
+            }
+        }
+
+        for (size_t i = 0; i < open.size(); ++i)
+        {
+            Cell const c = open[i];
+            size_t const x = c % width_, y = c / width_;
+            Distance const next_distance = get(x, y) + 1;
+
+            Place next[4];
+            size_t const n = neighbours(c, x, y, next);
+            for (size_t k = 0; k < n; ++k)
+            {
+                Place const& d = next[k];
+                if (not blocked[d.cell] and get(d.x, d.y) == UNREACHABLE)
+                {
+                    put(d.x, d.y, next_distance);
+                    open.push_back(d.cell);
+                }
+            }
+        }
+    }
+
+    // Brings the field up to date after the kinds of the given cells have
+    // changed, where kind() now describes the new grid. Works in two
+    // passes. The first finds the cells whose distance may have grown:
+    // the changed cells, and then, in order of distance, every cell none
+    // of whose neighbours one step closer to a target is still good. The
+    // second pass gives those cells, and the changed ones, the best
+    // distance their remaining neighbours allow, and spreads the new
+    // distances outward in order, as Dijkstra's algorithm would.
+    template<typename Kinds>
+    void update(Kinds const& kind, std::vector<Cell> const& changed)
+    {
+        Scratch& s = scratch();
+        if (s.bad.size() < width_ * height_)
+            s.bad.resize(width_ * height_, false);
+
+        std::vector<bool>& bad = s.bad;
+        std::vector<Cell>& lost = s.lost;
+        std::vector<Entry>& heap = s.heap;
+        lost.clear();
+        heap.clear();
+
+        for (size_t i = 0; i < changed.size(); ++i)
+        {
+            Cell const c = changed[i];
+            if (c < width_ * height_ and not bad[c]
+                and get(c % width_, c / width_) != UNREACHABLE)
+            {
+                bad[c] = true;
+                lost.push_back(c);
+                push(heap, Entry(get(c % width_, c / width_), c));
+            }
+        }
+
+        while (not heap.empty())
+        {
+            Entry const e = pop(heap);
+            Cell const c = e.second;
+
+            Place next[4];
+            size_t const n = neighbours(c, c % width_, c / width_, next);
+            for (size_t i = 0; i < n; ++i)
+            {
+                Place const& d = next[i];
+                if (not bad[d.cell] and get(d.x, d.y) == e.first + 1
+                    and not supported(kind, d, bad))
+                {
+                    bad[d.cell] = true;
+                    lost.push_back(d.cell);
+                    push(heap, Entry(e.first + 1, d.cell));
+                }
+            }
+        }
+
+        for (size_t i = 0; i < lost.size(); ++i)
+        {
+            bad[lost[i]] = false;
+            put(lost[i] % width_, lost[i] / width_, UNREACHABLE);
+        }
+
+        for (size_t i = 0; i < changed.size(); ++i)
+            if (changed[i] < width_ * height_)
+                lost.push_back(changed[i]);
+
+        for (size_t i = 0; i < lost.size(); ++i)
+        {
+            Cell const c = lost[i];
+            size_t const x = c % width_, y = c / width_;
+            Kind const k = kind(x, y);
+            Distance best = UNREACHABLE;
+
+            if (k == TARGET)
+                best = 0;
+            else if (k == OPEN)
+            {
+                Place next[4];
+                size_t const n = neighbours(c, x, y, next);
+                for (size_t j = 0; j < n; ++j)
+                {
+                    Distance const d = get(next[j].x, next[j].y);
+                    if (d != UNREACHABLE)
+                        best = std::min(best, d + 1);
+                }
+            }
+
+            if (best != get(x, y))
+                put(x, y, best);
+            if (best != UNREACHABLE)
+                push(heap, Entry(best, c));
+        }
+
+        while (not heap.empty())
+        {
+            Entry const e = pop(heap);
+            Cell const c = e.second;
+            size_t const x = c % width_, y = c / width_;
+            if (e.first > get(x, y))
+                continue;
+
+            Place next[4];
+            size_t const n = neighbours(c, x, y, next);
+            for (size_t i = 0; i < n; ++i)
+            {
+                Place const& d = next[i];
+                if (get(d.x, d.y) > e.first + 1 and
+                    kind(d.x, d.y) != BLOCKED)
+                {
+                    put(d.x, d.y, e.first + 1);
+                    push(heap, Entry(e.first + 1, d.cell));
+                }
+            }
+        }
+    }
+
+private:
+    // Tiles of 32 by 32 cells, stored row by row.
+    static size_t const TILE_BITS = 5;
+    static size_t const TILE_SIZE = size_t(1) << TILE_BITS;
+
+    struct Tile
+    {
+        Distance cells[TILE_SIZE * TILE_SIZE];
+    };
+
+    typedef std::tr1::shared_ptr<Tile> TilePtr;
+
+    // A cell together with its position.
+    struct Place
+    {
+        Cell cell;
+        size_t x, y;
+    };
+
+    typedef std::pair<Distance, Cell> Entry;
+
+    // Work space for update(), kept from call to call by each thread so
+    // that an update costs in proportion to the cells it looks at. The
+    // marks in bad are all cleared again by the end of each update.
+    struct Scratch
+    {
+        std::vector<bool> bad;
+        std::vector<Cell> lost;
+        std::vector<Entry> heap;
+    };
+
+    size_t width_, height_, columns_;
+    std::vector<TilePtr> tiles_;
+    std::vector<bool> mine_;
+    size_t owned_;
+
+    DistanceField& operator=(DistanceField const&);
+
+    static Scratch& scratch()
+    {
+        static thread_local Scratch s;
+        return s;
+    }
+
+    static TilePtr blank()
+    {
+        TilePtr const tile(new Tile);
+        std::fill(tile->cells, tile->cells + TILE_SIZE * TILE_SIZE,
+                  UNREACHABLE);
+        return tile;
+    }
+
+    static void push(std::vector<Entry>& heap, Entry const& e)
+    {
+        heap.push_back(e);
+        std::push_heap(heap.begin(), heap.end(), std::greater<Entry>());
+    }
+
+    static Entry pop(std::vector<Entry>& heap)
+    {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<Entry>());
+        Entry const e = heap.back();
+        heap.pop_back();
+        return e;
+    }
+
+    size_t tile(size_t const x, size_t const y) const
+    {
+        return (y >> TILE_BITS) * columns_ + (x >> TILE_BITS);
+    }
+
+    static size_t offset(size_t const x, size_t const y)
+    {
+        return ((y & (TILE_SIZE - 1)) << TILE_BITS) | (x & (TILE_SIZE - 1));
+    }
+
+    Distance get(size_t const x, size_t const y) const
+    {
+        return tiles_[tile(x, y)]->cells[offset(x, y)];
+    }
+
+    // Sets a cell, first copying its tile if it is shared.
+    void put(size_t const x, size_t const y, Distance const d)
+    {
+        size_t const t = tile(x, y);
+        if (not mine_[t])
+        {
+            tiles_[t].reset(new Tile(*tiles_[t]));
+            mine_[t] = true;
+            ++owned_;
+        }
+        tiles_[t]->cells[offset(x, y)] = d;
+    }
+
+    size_t neighbours(Cell const c, size_t const x, size_t const y,
+                      Place* next) const
+    {
+        size_t n = 0;
+
+        if (x > 0)
+        {
+            Place const p = { Cell(c - 1), x - 1, y };
+            next[n++] = p;
+        }
+        if (x + 1 < width_)
+        {
+            Place const p = { Cell(c + 1), x + 1, y };
+            next[n++] = p;
+        }
+        if (y > 0)
+        {
+            Place const p = { Cell(c - width_), x, y - 1 };
+            next[n++] = p;
+        }
+        if (y + 1 < height_)
+        {
+            Place const p = { Cell(c + width_), x, y + 1 };
+            next[n++] = p;
+        }
+
+        return n;
+    }
+
+    // Whether a cell, which has not been changed, still has a neighbour
+    // that is one step closer to a target and not itself in doubt.
+    template<typename Kinds>
+    bool supported(Kinds const& kind, Place const& c,
+                   std::vector<bool> const& bad) const
+    {
+        if (kind(c.x, c.y) == TARGET)
+            return true;
+
+        Distance const here = get(c.x, c.y);
+
+        Place next[4];
+        size_t const n = neighbours(c.cell, c.x, c.y, next);
+        for (size_t i = 0; i < n; ++i)
+        {
+            Distance const d = get(next[i].x, next[i].y);
+            if (not bad[next[i].cell] and d != UNREACHABLE and d + 1 == here)
+                return true;
+        }
+
+        return false;
+    }
+};
+
+// The distance fields computed so far for the games on one map, by a key
+// for the layout of blocked cells and targets they were computed for.
+// Games from different threads share the table, so it takes a lock. Once
+// it holds more than the given number of bytes, it drops the fields that
+// went longest without being looked up, as a clock would: fields go
+// round in the order they came in, and one that was looked up since it
+// last came round gets another turn. Games keep the fields they use alive
+// on their own.
+
+class DistanceFields
+{
+public:
+    typedef std::tr1::shared_ptr<DistanceField const> Field;
+
+    explicit DistanceFields(size_t const limit)
+        : limit_(limit),
+          bytes_(0)
+    {
+    }
+
+    Field find(std::uint64_t const key)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+
+        Table::iterator const i = table_.find(key);
+        if (i == table_.end())
+            return Field();
+
+        i->second.used = true;
+        return i->second.field;
+    }
+
+    void insert(std::uint64_t const key, Field const field)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+
+        Entry const entry = { field, field->bytes() + 48, false };
+        if (not table_.insert(Table::value_type(key, entry)).second)
+            return;
+        order_.push_back(key);
+        bytes_ += entry.bytes;
+
+        while (bytes_ > limit_ and order_.size() > 1)
+        {
+            std::uint64_t const oldest = order_.front();
+            order_.pop_front();
+
+            Table::iterator const i = table_.find(oldest);
+            if (i->second.used)
+            {
+                i->second.used = false;
+                order_.push_back(oldest);
+            }
+            else
+            {
+                bytes_ -= i->second.bytes;
+                table_.erase(i);
+            }
+        }
+    }
+
+    size_t bytes() const
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        return bytes_;
+    }
+
+private:
+    struct Entry
+    {
+        Field field;
+        size_t bytes;
+        bool used;
+    };
+
+    typedef std::unordered_map<std::uint64_t, Entry> Table;
+
+    size_t limit_;
+    size_t bytes_;
+    Table table_;
+    std::deque<std::uint64_t> order_;
+    mutable std::mutex lock_;
+};
+
+#endif
@@ -6,17 +6,22 @@
  *  Project: lambdaminer (potential ICFP 2012 contest entry)
  *  Date: 2012-07-16
  *
- *  Declaration of the Game class.
+ *  Declaration of the Game class template.
  *
  */
 
 #ifndef LAMBDAMINER_GAME_H
 #define LAMBDAMINER_GAME_H 1
 
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <vector>
 
+#include "Counters.hpp"
+#include "DistanceField.hpp"
+#include "MapText.hpp"
+#include "PackedGrid.hpp"
 #include "QuadCache.hpp"
 
 using std::vector;
@@ -27,17 +32,65 @@ typedef enum
 }
     FieldType;
 
+// Counts of the work done by all games in the process. They are only kept
+// once switched on, since the threads of a search would otherwise contend
+// for them with every step.
 
-class Game
+struct GameCounters
+{
+    bool enabled;
+    Counter steps;       // steps taken in ongoing games
+    Counter advances;    // steps that let every rock on the map fall
+    Counter set_calls;   // single and batched updates of the map
+    Counter cells_set;   // cells written by those updates
+
+    GameCounters()
+        : enabled(false)
+    {
+    }
+};
+
+extern GameCounters game_counters;
+
+// Writes the counts above as members of a JSON object.
+
+void write_game_counters(Json& json);
+
+
+// The game on a map kept in the given storage, which is either a QuadCache
+// or a PackedGrid over unsigned char.
+
+template<typename Storage>
+class BasicGame
 {
     typedef enum { ONGOING, WON, LOST, ABORTED } GameState;
     typedef unsigned char Field;
-    typedef vector<Field> Row;
+    typedef std::uint32_t Cell;
+    typedef vector<Cell> Cells;
 
 public:
-    typedef QuadCache<Field>::Map Map;
+    typedef Storage Cache;
+    typedef typename Cache::Map Map;
+    typedef typename Cache::Update Update;
+    typedef vector<Update> Updates;
 
-    explicit Game(std::istream& input);
+    // The parts of a game that change from move to move. Games on the same
+    // map share everything else, so searches can keep a snapshot per
+    // position instead of a whole game.
+    struct Snapshot
+    {
+        Map map;
+        std::tr1::shared_ptr<Cells const> unstable;
+        std::uint64_t key, layout;
+        std::uint32_t x, y;
+        std::int32_t moves, lambdas_left, lambdas_collected;
+        unsigned char state;
+        bool all_unstable;
+    };
+
+    explicit BasicGame(std::istream& input);
+
+    explicit BasicGame(MapText const& text);
 
     size_t width() const { return width_; }
     size_t height() const { return height_; }
@@ -61,6 +114,36 @@ public:
 
     int moves() const { return moves_; }
 
+    size_t robot_x() const { return x_; }
+    size_t robot_y() const { return y_; }
+
+    // A Zobrist key for the state of the game, covering the map contents
+    // (and thus the robot position), the number of lambdas collected and
+    // whether the game is still on. It is updated incrementally with every
+    // change.
+    std::uint64_t key() const { return key_; }
+
+    // The number of steps from the robot to the nearest lambda left, or
+    // to the lift once all are collected, going around walls, rocks and
+    // the closed lift, or UNREACHABLE if there is no way. Rocks that could
+    // be pushed aside count as walls, so this is a guide, not a bound.
+    DistanceField::Distance distance() const
+    {
+        return distances().at(x_, y_);
+    }
+
+    // The distances to the nearest target for the whole map. Games share
+    // these while blocked cells and targets stay put, and work out new
+    // ones from the old when they move. A game only gets its field once
+    // asked for it, or from the game it was stepped from, so games that
+    // are merely played never pay for one.
+    DistanceField const& distances() const
+    {
+        if (not field_)
+            find_field();
+        return *field_;
+    }
+
     int score() const
     {
         switch (state_)
@@ -74,19 +157,132 @@ public:
         }
     }
 
-    Game step(char const move) const;
+    BasicGame step(char const move) const;
 
     Map map() const { return map_; }
 
+    Cache cache() const { return cache_; }
+
     void cache_info() const { cache_.info(); }
 
+    // The bytes held by the distance fields kept for reuse.
+    size_t field_bytes() const { return fields_->bytes(); }
+
+    Snapshot snapshot() const
+    {
+        Snapshot const s = { map_, unstable_, key_, layout_,
+                             std::uint32_t(x_), std::uint32_t(y_),
+                             moves_, lambdas_left_, lambdas_collected_,
+                             (unsigned char) state_, all_unstable_ };
+        return s;
+    }
+
+    // Roughly the number of bytes a snapshot of this game holds on its
+    // own, beyond its own size and what the cache accounts for.
+    size_t snapshot_bytes() const
+    {
+        size_t n = cache_.map_bytes(map_);
+        if (unstable_)
+            n += sizeof(Cells) + unstable_->capacity() * sizeof(Cell) + 32;
+        return n;
+    }
+
+    // The game on the same map as this one in the given position.
+    BasicGame restore(Snapshot const& s) const
+    {
+        BasicGame game(*this);
+
+        game.map_ = s.map;
+        game.unstable_ = s.unstable;
+        game.key_ = s.key;
+        game.layout_ = s.layout;
+        game.x_ = s.x;
+        game.y_ = s.y;
+        game.moves_ = s.moves;
+        game.lambdas_left_ = s.lambdas_left;
+        game.lambdas_collected_ = s.lambdas_collected;
+        game.state_ = GameState(s.state);
+        game.all_unstable_ = s.all_unstable;
+        game.field_ = fields_->find(s.layout);
+
+        return game;
+    }
+
 private:
-    QuadCache<Field> cache_;
+    Cache cache_;
     Map map_;
     size_t width_, height_;
     size_t x_, y_;
+    size_t lift_x_, lift_y_;
     int moves_, lambdas_left_, lambdas_collected_;
     GameState state_;
+    std::uint64_t key_;
+
+    // The rocks that might move in the next step, as sorted cell numbers.
+    // These are the rocks next to a cell that changed in the last step.
+    // Until the first step, every rock counts as unstable.
+    std::tr1::shared_ptr<Cells const> unstable_;
+    bool all_unstable_;
+
+    // The distance field for the current layout of blocked cells and
+    // targets, and a Zobrist key for that layout, kept like key_.
+    std::tr1::shared_ptr<DistanceFields> fields_;
+    mutable DistanceFields::Field field_;
+    std::uint64_t layout_;
+
+    // Converts the lines of a map text into rows for the storage.
+    struct Loader
+    {
+        MapText const& text;
+
+        void operator()(size_t const y, Field* row) const;
+    };
+
+    // Reads the kind of each cell off a game, for DistanceField.
+    struct Kinds
+    {
+        BasicGame const& game;
+
+        DistanceField::Kind operator()(size_t const x, size_t const y) const
+        {
+            return game.kind(game.at(x, y));
+        }
+
+        void operator()(size_t const y, DistanceField::Kind* row) const
+        {
+            typename Map::Cursor c(game.map_, y);
+            for (size_t x = 0; x < game.width(); ++x, ++c)
+                row[x] = game.kind(*c);
+        }
+    };
+
+    DistanceField::Kind kind(Field const value) const
+    {
+        switch (value)
+        {
+        case WALL:
+        case ROCK:
+            return DistanceField::BLOCKED;
+        case LAMBDA:
+        case LIFT_OPEN:
+            return DistanceField::TARGET;
+        case LIFT_CLOSED:
+            return lambdas_left_ == 0
+                ? DistanceField::TARGET : DistanceField::BLOCKED;
+        default:
+            return DistanceField::OPEN;
+        }
+    }
+
+    std::uint64_t layout_key(size_t const x, size_t const y,
+                             DistanceField::Kind const k) const
+    {
+        return k == DistanceField::OPEN ? 0 : zobrist(3, 4 * cell(x, y) + k);
+    }
+
+    void find_field() const;
+
+    void update_field(BasicGame const& previous, Cells& touched);
 
     bool on_map(size_t const x, size_t const y) const
     {
@@ -98,8 +294,13 @@ private:
         return at(x, y) == SPACE;
     }
 
+    // Squares off the map count as walls, whatever the storage fills them
+    // with, so that the robot cannot leave a map without a wall around it.
+
     bool is_free(size_t const x, size_t const y) const
     {
+        if (not on_map(x, y))
+            return false;
         switch (at(x, y))
         {
         case SPACE:
@@ -112,23 +313,151 @@ private:
         }
     }
 
+    static std::uint64_t zobrist(std::uint64_t const kind,
+                                 std::uint64_t const value)
+    {
+        std::uint64_t z = (kind << 56) + value + 0x9e3779b97f4a7c15ull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    std::uint64_t field_key(size_t const x, size_t const y,
+                            Field const value) const
+    {
+        return zobrist(0, 8 * cell(x, y) + value);
+    }
+
+    void count_set(size_t const cells) const
+    {
+        if (game_counters.enabled)
+        {
+            game_counters.set_calls.add();
+            game_counters.cells_set.add(cells);
+        }
+    }
+
     void set(size_t const x, size_t const y, Field const value)
     {
+        count_set(1);
+        if (on_map(x, y))
+            key_ ^= field_key(x, y, at(x, y)) ^ field_key(x, y, value);
         map_ = map_.set(x, y, value);
     }
 
+    // Applies a batch of updates in one go. If a cell appears more than
+    // once, the last update wins.
+    void set_many(Updates& updates)
+    {
+        count_set(updates.size());
+        Map const next = map_.set_many(updates);
+
+        Cells touched;
+        for (size_t i = 0; i < updates.size(); ++i)
+            if (on_map(updates[i].x, updates[i].y))
+                touched.push_back(cell(updates[i].x, updates[i].y));
+        std::sort(touched.begin(), touched.end());
+        touched.erase(std::unique(touched.begin(), touched.end()),
+                      touched.end());
+
+        for (size_t i = 0; i < touched.size(); ++i)
+        {
+            size_t const x = touched[i] % width(), y = touched[i] / width();
+            key_ ^= field_key(x, y, at(x, y))
+                ^ field_key(x, y, next.at(x, y));
+        }
+
+        map_ = next;
+    }
+
+    void set_state(GameState const state)
+    {
+        key_ ^= zobrist(1, state_) ^ zobrist(1, state);
+        state_ = state;
+    }
+
+    void collect_lambda()
+    {
+        key_ ^= zobrist(2, lambdas_collected_);
+        ++lambdas_collected_;
+        --lambdas_left_;
+        key_ ^= zobrist(2, lambdas_collected_);
+    }
+
+    Cell cell(size_t const x, size_t const y) const
+    {
+        return y * width() + x;
+    }
+
+    void add_cell(size_t const x, size_t const y, Cells& cells) const
+    {
+        if (on_map(x, y))
+            cells.push_back(cell(x, y));
+    }
+
     void rock_fall(size_t const xo, size_t const yo,
-                   size_t const xn, size_t const yn)
+                   size_t const xn, size_t const yn,
+                   Updates& updates, Cells& changed) const
     {
-        set(xo, yo, SPACE);
-        set(xn, yn, ROCK);
-        if (at(xn, yn-1) == ROBOT)
-            state_ = LOST;
+        Update const from = { xo, yo, SPACE }, to = { xn, yn, ROCK };
+        updates.push_back(from);
+        updates.push_back(to);
+        changed.push_back(cell(xo, yo));
+        changed.push_back(cell(xn, yn));
     }
 
-    Game move_robot(char const move) const;
+    void settle_rock(size_t const x, size_t const y,
+                     Updates& updates, Cells& changed) const;
+
+    void add_neighbours(size_t const x, size_t const y, Cells& cells) const;
+
+    BasicGame move_robot(char const move) const;
 };
 
-std::ostream& operator<<(std::ostream& output, Game const& m);
+typedef BasicGame<QuadCache<unsigned char> > Game;
+typedef BasicGame<PackedGrid<unsigned char> > PackedGame;
+
+template<typename Storage>
+std::ostream& operator<<(std::ostream& output, BasicGame<Storage> const& m);
+
+// Maps with at most this many cells are kept in a PackedGrid by default.
+
+size_t const PACKED_GRID_MAX_CELLS = 64 * 64;
+
+typedef enum { AUTO_STORAGE, QUAD_STORAGE, PACKED_STORAGE } StorageKind;
+
+// Parses "quad", "packed" or "auto"; anything else means automatic.
+
+StorageKind parse_storage(std::string const& name);
+
+// Calls f with the map as a Game or a PackedGame, depending on the
+// storage asked for or, by default, on the size of the map. Returns what
+// f returns.
+
+template<typename F>
+int with_game(MapText const& text, StorageKind kind, F& f)
+{
+    if (kind == AUTO_STORAGE)
+        kind = text.width() * text.height() <= PACKED_GRID_MAX_CELLS
+            ? PACKED_STORAGE : QUAD_STORAGE;
+
+    if (kind == PACKED_STORAGE)
+    {
+        PackedGame const game(text);
+        return f(game);
+    }
+    else
+    {
+        Game const game(text);
+        return f(game);
+    }
+}
+
+template<typename F>
+int with_game(std::istream& input, StorageKind kind, F& f)
+{
+    MapText const text(input);
+    return with_game(text, kind, f);
+}
 
 #endif
@@ -0,0 +1,161 @@
+/** -*-c++-*-
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ *  File: MapText.hpp
+ *  Project: lambdaminer (potential ICFP 2012 contest entry)
+ *  Date: 2012-07-16
+ *
+ *  The text of a map, mapped into memory straight from its file where
+ *  possible, with the positions of its lines.
+ *
+ */
+
+#ifndef LAMBDAMINER_MAPTEXT_HPP
+#define LAMBDAMINER_MAPTEXT_HPP 1
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::size_t;
+
+// The map is made of the lines up to the first empty one. Lines are
+// numbered from the bottom up, like the rows of a game, and only their
+// positions are kept, so the map is read straight from the text when a
+// game is built.
+
+class MapText
+{
+public:
+    // Reads the text from a stream.
+    explicit MapText(std::istream& input)
+        : mapped_(0),
+          size_(0),
+          good_(true)
+    {
+        std::ostringstream text;
+        text << input.rdbuf();
+        copy_ = text.str();
+        index(copy_.data(), copy_.size());
+    }
+
+    // Maps the file at the given path into memory, or reads it in if it
+    // cannot be mapped, as for a pipe. Check good() for whether the file
+    // could be opened at all.
+    explicit MapText(char const* path)
+        : mapped_(0),
+          size_(0),
+          good_(false)
+    {
+        int const fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return;
+        good_ = true;
+
+        struct stat info;
+        if (::fstat(fd, &info) == 0 and S_ISREG(info.st_mode)
+            and info.st_size > 0)
+        {
+            void* const p = ::mmap(0, info.st_size, PROT_READ, MAP_PRIVATE,
+                                   fd, 0);
+            if (p != MAP_FAILED)
+            {
+                mapped_ = static_cast<char const*>(p);
+                size_ = info.st_size;
+            }
+        }
+
+        if (mapped_ == 0)
+        {
+            char buffer[1 << 16];
+            ssize_t n;
+            while ((n = ::read(fd, buffer, sizeof(buffer))) > 0)
+                copy_.append(buffer, n);
+        }
+        ::close(fd);
+
+        if (mapped_ != 0)
+        {
+            index(mapped_, size_);
+            if (height() > 0)
+                release(height() - 1);
+        }
+        else
+            index(copy_.data(), copy_.size());
+    }
+
+    ~MapText()
+    {
+        if (mapped_ != 0)
+            ::munmap(const_cast<char*>(mapped_), size_);
+    }
+
+    bool good() const { return good_; }
+
+    size_t width() const { return width_; }
+    size_t height() const { return lines_.size(); }
+
+    // The start of line y, counting from the bottom, and its length.
+    char const* line(size_t const y) const
+    {
+        return lines_.at(height() - 1 - y).first;
+    }
+
+    size_t line_size(size_t const y) const
+    {
+        return lines_.at(height() - 1 - y).second;
+    }
+
+    // Lets the system drop the pages of a mapped file holding lines y and
+    // below, counting from the bottom, once they have been read. They are
+    // read in again if needed, so this only trims the resident memory.
+    void release(size_t const y) const
+    {
+        if (mapped_ == 0 or y >= height())
+            return;
+
+        size_t const page = ::sysconf(_SC_PAGESIZE);
+        size_t const from = (line(y) - mapped_ + page - 1) / page * page;
+        if (from < size_)
+            ::madvise(const_cast<char*>(mapped_) + from, size_ - from,
+                      MADV_DONTNEED);
+    }
+
+private:
+    std::string copy_;
+    char const* mapped_;
+    size_t size_;
+    bool good_;
+    size_t width_;
+    std::vector<std::pair<char const*, size_t> > lines_;
+
+    MapText(MapText const&);
+    MapText& operator=(MapText const&);
+
+    void index(char const* const text, size_t const size)
+    {
+        char const* const end = text + size;
+        width_ = 0;
+
+        for (char const* p = text; p < end; )
+        {
+            char const* const eol = std::find(p, end, '\n');
+            if (eol == p)
+                break;
+
+            lines_.push_back(std::make_pair(p, size_t(eol - p)));
+            width_ = std::max(width_, size_t(eol - p));
+            p = eol + 1;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,497 @@
+/** -*-c++-*-
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ *  File: PackedGrid.hpp
+ *  Project: lambdaminer (potential ICFP 2012 contest entry)
+ *  Date: 2012-07-16
+ *
+ *  A dense grid with four bits per cell, as an alternative to QuadCache
+ *  for small maps.
+ *
+ *  Rows are packed into 64-bit words, sixteen cells to a word, and groups
+ *  of rows are kept in reference counted chunks of about a cache line.
+ *  Maps share all chunks they do not modify, so copying a map costs one
+ *  reference count and setting a cell copies a single chunk.
+ *
+ */
+
+#ifndef LAMBDAMINER_PACKEDGRID_HPP
+#define LAMBDAMINER_PACKEDGRID_HPP 1
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+#include <tr1/memory>
+
+#include "Counters.hpp"
+
+using std::size_t;
+
+// ValueType must be an integral type with values below 16.
+
+template<typename ValueType>
+class PackedGrid
+{
+public:
+    typedef std::uint64_t Word;
+
+    static size_t const CELLS_PER_WORD = 16;
+
+    struct Update
+    {
+        size_t x, y;
+        ValueType value;
+    };
+
+private:
+    typedef std::vector<Word> Chunk;
+    typedef std::tr1::shared_ptr<Chunk const> ChunkPtr;
+    typedef std::vector<ChunkPtr> Spine;
+    typedef std::tr1::shared_ptr<Spine const> SpinePtr;
+
+    struct Shape
+    {
+        ValueType filler;
+        size_t width, height;
+        size_t words;       // words per row
+        size_t rows;        // rows per chunk
+        std::vector<Word> filler_row;
+    };
+
+    typedef std::tr1::shared_ptr<Shape const> ShapePtr;
+
+public:
+    class Map
+    {
+    public:
+        Map()
+        {
+        }
+
+        ValueType at(size_t const x, size_t const y) const
+        {
+            Shape const& s = *shape_;
+
+            if (x >= s.width or y >= s.height)
+                return s.filler;
+            else
+                return (word(y, x / CELLS_PER_WORD)
+                        >> (4 * (x % CELLS_PER_WORD))) & 15;
+        }
+
+        Map set(size_t const x, size_t const y, ValueType const val) const
+        {
+            Shape const& s = *shape_;
+
+            if (x >= s.width or y >= s.height or at(x, y) == val)
+                return *this;
+
+            size_t const c = y / s.rows;
+            size_t const i = (y % s.rows) * s.words + x / CELLS_PER_WORD;
+            size_t const shift = 4 * (x % CELLS_PER_WORD);
+
+            Chunk* chunk = new Chunk(*spine_->at(c));
+            chunk->at(i) = (chunk->at(i) & ~(Word(15) << shift))
+                | (Word(val) << shift);
+
+            Spine* spine = new Spine(*spine_);
+            spine->at(c) = ChunkPtr(chunk);
+
+            return Map(shape_, SpinePtr(spine));
+        }
+
+        // Sets several cells at once, copying the spine and each chunk
+        // touched only once. If a cell appears more than once, the last
+        // update wins.
+        Map set_many(std::vector<Update>& updates) const
+        {
+            Shape const& s = *shape_;
+            Spine* spine = 0;
+            std::vector<Chunk*> copies;
+
+            for (size_t k = 0; k < updates.size(); ++k)
+            {
+                Update const& u = updates[k];
+                if (u.x >= s.width or u.y >= s.height)
+                    continue;
+
+                size_t const c = u.y / s.rows;
+                size_t const i =
+                    (u.y % s.rows) * s.words + u.x / CELLS_PER_WORD;
+                size_t const shift = 4 * (u.x % CELLS_PER_WORD);
+                Chunk const& current = copies.empty() or copies.at(c) == 0
+                    ? *spine_->at(c) : *copies.at(c);
+
+                if (((current.at(i) >> shift) & 15) == Word(u.value))
+                    continue;
+
+                if (spine == 0)
+                {
+                    spine = new Spine(*spine_);
+                    copies.assign(spine->size(), 0);
+                }
+                if (copies.at(c) == 0)
+                {
+                    copies.at(c) = new Chunk(*spine_->at(c));
+                    spine->at(c) = ChunkPtr(copies.at(c));
+                }
+
+                Word& w = copies.at(c)->at(i);
+                w = (w & ~(Word(15) << shift)) | (Word(u.value) << shift);
+            }
+
+            return spine == 0 ? *this : Map(shape_, SpinePtr(spine));
+        }
+
+        // Applies a rule to every row at once. The rule is called as
+        // rule(below, row, above, words, out) with three consecutive rows
+        // of packed words and must write the new contents of the middle
+        // row to out. Rows outside the map count as filled with the
+        // filler value. Chunks without changes are shared with this map.
+        template<typename Rule>
+        Map advance(Rule const& rule) const
+        {
+            Shape const& s = *shape_;
+            Spine* spine = 0;
+            Chunk next(s.rows * s.words);
+
+            for (size_t c = 0; c < spine_->size(); ++c)
+            {
+                Chunk const& old = *spine_->at(c);
+                bool changed = false;
+
+                for (size_t r = 0; r < s.rows; ++r)
+                {
+                    size_t const y = c * s.rows + r;
+                    Word* out = &next.at(r * s.words);
+
+                    if (y >= s.height)
+                        std::copy(s.filler_row.begin(), s.filler_row.end(),
+                                  out);
+                    else
+                        rule(row(y - 1), row(y), row(y + 1), s.words, out);
+
+                    for (size_t i = 0; i < s.words; ++i)
+                        changed = changed or out[i] != old.at(r*s.words + i);
+                }
+
+                if (changed)
+                {
+                    if (spine == 0)
+                        spine = new Spine(*spine_);
+                    spine->at(c) = ChunkPtr(new Chunk(next));
+                }
+            }
+
+            return spine == 0 ? *this : Map(shape_, SpinePtr(spine));
+        }
+
+        // Calls f(x, y) for every cell in which this map differs from
+        // the other one, which must come from the same grid.
+        template<typename F>
+        void diff(Map const other, F& f) const
+        {
+            Shape const& s = *shape_;
+
+            for (size_t c = 0; c < spine_->size(); ++c)
+            {
+                Chunk const& a = *spine_->at(c);
+                Chunk const& b = *other.spine_->at(c);
+                if (&a == &b)
+                    continue;
+
+                for (size_t i = 0; i < a.size(); ++i)
+                {
+                    Word d = a.at(i) ^ b.at(i);
+                    while (d != 0)
+                    {
+                        size_t const n = __builtin_ctzll(d) / 4;
+                        f(i % s.words * CELLS_PER_WORD + n,
+                          c * s.rows + i / s.words);
+                        d &= ~(Word(15) << (4 * n));
+                    }
+                }
+            }
+        }
+
+        bool operator==(Map const other) const
+        {
+            return spine_ == other.spine_;
+        }
+
+        bool operator!=(Map const other) const
+        {
+            return spine_ != other.spine_;
+        }
+
+        // Reads a row of a map from left to right, like the cursor of
+        // QuadCache.
+        class Cursor
+        {
+        public:
+            Cursor(Map const& map, size_t const y)
+                : shape_(map.shape_.get()),
+                  row_(map.row(y)),
+                  x_(0)
+            {
+            }
+
+            size_t x() const { return x_; }
+
+            ValueType operator*() const
+            {
+                if (x_ >= shape_->width)
+                    return shape_->filler;
+                else
+                    return (row_[x_ / CELLS_PER_WORD]
+                            >> (4 * (x_ % CELLS_PER_WORD))) & 15;
+            }
+
+            Cursor& operator++()
+            {
+                ++x_;
+                return *this;
+            }
+
+        private:
+            Shape const* shape_;
+            Word const* row_;
+            size_t x_;
+        };
+
+    private:
+        friend class PackedGrid;
+
+        ShapePtr shape_;
+        SpinePtr spine_;
+
+        Map(ShapePtr const shape, SpinePtr const spine)
+            : shape_(shape),
+              spine_(spine)
+        {
+        }
+
+        Word word(size_t const y, size_t const i) const
+        {
+            Shape const& s = *shape_;
+            return spine_->at(y / s.rows)->at((y % s.rows) * s.words + i);
+        }
+
+        Word const* row(size_t const y) const
+        {
+            Shape const& s = *shape_;
+
+            if (y >= s.height)
+                return &s.filler_row.at(0);
+            else
+                return &spine_->at(y / s.rows)->at((y % s.rows) * s.words);
+        }
+    };
+
+    PackedGrid()
+    {
+    }
+
+    // Packs the rows supplied by the caller as rows(y, out), which must
+    // write the width values of row y to out and is called once for each
+    // row, in increasing order of y.
+    template<typename Rows>
+    PackedGrid(size_t const width, size_t const height, Rows& rows,
+               ValueType const filler)
+    {
+        Shape* s = new Shape();
+
+        s->filler = filler;
+        s->height = height;
+        s->width = width;
+
+        s->words = std::max(size_t(1),
+                            (s->width + CELLS_PER_WORD - 1) / CELLS_PER_WORD);
+        s->rows = std::max(size_t(1), 8 / s->words);
+
+        Word all = 0;
+        for (size_t n = 0; n < CELLS_PER_WORD; ++n)
+            all |= Word(filler) << (4 * n);
+        s->filler_row.assign(s->words, all);
+
+        size_t const chunks = (s->height + s->rows - 1) / s->rows;
+        Spine* spine = new Spine();
+        std::vector<ValueType> row(s->width);
+
+        for (size_t c = 0; c < std::max(size_t(1), chunks); ++c)
+        {
+            Chunk* chunk = new Chunk(s->rows * s->words, all);
+
+            for (size_t r = 0; r < s->rows; ++r)
+            {
+                size_t const y = c * s->rows + r;
+                if (y >= s->height)
+                    continue;
+
+                if (s->width > 0)
+                    rows(y, &row.at(0));
+                for (size_t x = 0; x < row.size(); ++x)
+                {
+                    size_t const i = r * s->words + x / CELLS_PER_WORD;
+                    size_t const shift = 4 * (x % CELLS_PER_WORD);
+                    chunk->at(i) = (chunk->at(i) & ~(Word(15) << shift))
+                        | (Word(row.at(x)) << shift);
+                }
+            }
+            spine->push_back(ChunkPtr(chunk));
+        }
+
+        original_ = Map(ShapePtr(s), SpinePtr(spine));
+    }
+
+    Map original()
+    {
+        return original_;
+    }
+
+    // Maps are reference counted, so there is nothing to collect and no
+    // shared state to protect. These exist to match QuadCache.
+
+    void set_memory_limit(size_t const)
+    {
+    }
+
+    bool needs_collection() const
+    {
+        return false;
+    }
+
+    size_t live_bytes() const
+    {
+        return 0;
+    }
+
+    size_t bytes() const
+    {
+        return 0;
+    }
+
+    // Roughly the number of bytes a map holds on its own, assuming that
+    // it shares all but one chunk with the map it was made from, and
+    // allowing 32 bytes for each reference count.
+    size_t map_bytes(Map const m) const
+    {
+        Shape const& s = *m.shape_;
+        return m.spine_->size() * sizeof(ChunkPtr) + sizeof(Spine)
+            + s.rows * s.words * sizeof(Word) + sizeof(Chunk) + 2 * 32;
+    }
+
+    size_t collect(std::vector<Map> const&)
+    {
+        return 0;
+    }
+
+    void set_threads(size_t const)
+    {
+    }
+
+    void info() const
+    {
+        Shape const& s = *original_.shape_;
+
+        std::cerr << s.width << "x" << s.height << " packed grid, "
+                  << s.words << " words per row, "
+                  << s.rows << " rows per chunk" << std::endl;
+    }
+
+    // Writes the chunks of the given maps, each distinct one once, and
+    // then the chunks of each map by their position in that list. Out
+    // must provide put(value) and put_bytes(data, n), as BinaryWriter
+    // does.
+    template<typename Out>
+    void save(std::vector<Map> const& maps, Out& out) const
+    {
+        Shape const& s = *original_.shape_;
+        size_t const words = s.rows * s.words;
+        std::unordered_map<Chunk const*, std::uint32_t> ids;
+        std::vector<Chunk const*> order;
+
+        for (size_t i = 0; i < maps.size(); ++i)
+        {
+            Spine const& spine = *maps.at(i).spine_;
+            for (size_t c = 0; c < spine.size(); ++c)
+                if (ids.insert(std::make_pair(spine.at(c).get(),
+                                              order.size())).second)
+                    order.push_back(spine.at(c).get());
+        }
+
+        out.put(std::uint32_t(words));
+        out.put(std::uint32_t(original_.spine_->size()));
+
+        out.put(std::uint64_t(order.size()));
+        for (size_t i = 0; i < order.size(); ++i)
+            out.put_bytes(&order.at(i)->at(0), words * sizeof(Word));
+
+        out.put(std::uint64_t(maps.size()));
+        for (size_t i = 0; i < maps.size(); ++i)
+        {
+            Spine const& spine = *maps.at(i).spine_;
+            for (size_t c = 0; c < spine.size(); ++c)
+                out.put(ids[spine.at(c).get()]);
+        }
+    }
+
+    // Reads maps written by save() for a grid of the same shape and
+    // appends them to maps. In must provide get<T>(), count<T>(each) and
+    // bytes(n), as BinaryReader does.
+    template<typename In>
+    void load(In& in, std::vector<Map>& maps)
+    {
+        Shape const& s = *original_.shape_;
+        size_t const words = s.rows * s.words;
+        size_t const length = original_.spine_->size();
+
+        if (in.template get<std::uint32_t>() != words
+            or in.template get<std::uint32_t>() != length)
+            throw "Saved maps do not fit this grid.";
+
+        std::vector<ChunkPtr> chunks(
+            in.template count<std::uint64_t>(words * sizeof(Word)));
+        for (size_t i = 0; i < chunks.size(); ++i)
+        {
+            Chunk* chunk = new Chunk(words);
+            std::memcpy(&chunk->at(0), in.bytes(words * sizeof(Word)),
+                        words * sizeof(Word));
+            chunks.at(i) = ChunkPtr(chunk);
+        }
+
+        size_t const n = in.template count<std::uint64_t>(
+            length * sizeof(std::uint32_t));
+        for (size_t i = 0; i < n; ++i)
+        {
+            Spine* spine = new Spine(length);
+            for (size_t c = 0; c < length; ++c)
+                spine->at(c) = chunks.at(in.template get<std::uint32_t>());
+            maps.push_back(Map(original_.shape_, SpinePtr(spine)));
+        }
+    }
+
+    // Writes the shape of the grid as members of a JSON object. There is
+    // nothing shared to count beyond what the maps copy themselves.
+    void counters(Json& json) const
+    {
+        Shape const& s = *original_.shape_;
+
+        json.member("kind", "packed")
+            .member("width", s.width)
+            .member("height", s.height)
+            .member("words_per_row", s.words)
+            .member("rows_per_chunk", s.rows);
+    }
+
+private:
+    Map original_;
+};
+
+template<typename ValueType>
+size_t const PackedGrid<ValueType>::CELLS_PER_WORD;
+
+#endif
@@ -8,78 +8,945 @@
  *
  *  A quad tree that caches square contents on every level.
  *
+ *  The leaves are square tiles of 2, 4 or 8 cells on a side, stored
+ *  inline. Nodes live in per-level pools and are addressed by 32-bit indices.
+ *  Every node is interned, so two maps with the same contents share the
+ *  same root index. Nodes that are no longer reachable from any map in
+ *  use can be reclaimed with collect(); their slots are then reused.
+ *
  */
 
 #ifndef LAMBDAMINER_QUADCACHE_HPP
 #define LAMBDAMINER_QUADCACHE_HPP 1
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <mutex>
 #include <vector>
+#include <unordered_map>
 #include <unordered_set>
 #include <tr1/memory>
 
+#include "Counters.hpp"
+
 using std::size_t;
 
-template<typename ValueType>
+// The leaves are tiles with 1 << LEAF_BITS cells on a side.
+
+template<typename ValueType, size_t LEAF_BITS = 3>
 class QuadCache
 {
-    struct Node;
+public:
+    typedef std::uint32_t Index;
 
-    typedef std::tr1::shared_ptr<Node> NodePtr;
+    static size_t const LEAF_SIZE = size_t(1) << LEAF_BITS;
+    static size_t const LEAF_CELLS = LEAF_SIZE * LEAF_SIZE;
 
-    struct Entry
+    struct Update
     {
-        ValueType val;
-        NodePtr node;
+        size_t x, y;
+        ValueType value;
     };
 
+private:
+    static Index const NONE = ~Index(0);
+
+    // Children are stored in the order se, sw, ne, nw, which is also the
+    // order of the quadrant number (y >= e) * 2 + (x >= e). Leaf values
+    // are stored row by row.
+
     struct Node
     {
-        size_t extent;
-        Entry se, sw, ne, nw;
+        Index child[4];
+
+        bool operator==(Node const& other) const
+        {
+            return (child[0] == other.child[0] and
+                    child[1] == other.child[1] and
+                    child[2] == other.child[2] and
+                    child[3] == other.child[3]);
+        }
+
+        size_t hash() const
+        {
+            size_t h = 0;
+            for (int i = 0; i < 4; ++i)
+                h = (h ^ child[i]) * 0x9e3779b97f4a7c15ull;
+            return h ^ (h >> 29);
+        }
     };
 
-    struct Hash
+    struct Leaf
     {
-        std::size_t operator()(NodePtr n) const
+        ValueType val[LEAF_CELLS];
+
+        bool operator==(Leaf const& other) const
+        {
+            return std::equal(val, val + LEAF_CELLS, other.val);
+        }
+
+        size_t hash() const
         {
             size_t h = 0;
+            for (size_t i = 0; i < LEAF_CELLS; ++i)
+                h = (h ^ (size_t) val[i]) * 0x9e3779b97f4a7c15ull;
+            return h ^ (h >> 29);
+        }
+    };
+
+    // A growable array of items that never moves items once allocated.
+    // Once reserve_all() has been called, the chunk directory does not
+    // move either, so items can be read while another thread appends.
+
+    template<typename T>
+    class Pool
+    {
+        static size_t const CHUNK_BITS = 12;
+        static size_t const CHUNK_SIZE = size_t(1) << CHUNK_BITS;
+
+        std::vector<T*> chunks_;
+        size_t size_;
+
+        Pool(Pool const&);
+        Pool& operator=(Pool const&);
+
+    public:
+        Pool()
+            : size_(0)
+        {
+        }
+
+        ~Pool()
+        {
+            for (size_t i = 0; i < chunks_.size(); ++i)
+                delete[] chunks_.at(i);
+        }
+
+        size_t size() const { return size_; }
+
+        size_t bytes() const
+        {
+            return chunks_.size() * CHUNK_SIZE * sizeof(T);
+        }
+
+        void reserve_all()
+        {
+            chunks_.reserve((size_t(NONE) + 1) >> CHUNK_BITS);
+        }
+
+        T const& operator[](Index const i) const
+        {
+            return chunks_[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)];
+        }
+
+        T& operator[](Index const i)
+        {
+            return chunks_[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)];
+        }
+
+        Index push()
+        {
+            if (size_ == chunks_.size() * CHUNK_SIZE)
+                chunks_.push_back(new T[CHUNK_SIZE]);
+            return size_++;
+        }
+    };
+
+    // A lock that is only taken while the cache is shared between threads.
+
+    class Guard
+    {
+        std::mutex* mutex_;
+
+        Guard(Guard const&);
+        Guard& operator=(Guard const&);
+
+    public:
+        Guard(std::mutex& mutex, bool const active)
+            : mutex_(active ? &mutex : 0)
+        {
+            if (mutex_)
+                mutex_->lock();
+        }
+
+        ~Guard()
+        {
+            if (mutex_)
+                mutex_->unlock();
+        }
+    };
+
+    // The nodes of one tree level, together with an open addressing hash
+    // table that maps node contents to their pool indices. Each node also
+    // has a slot for the memoized result of advance().
+    //
+    // In concurrent mode the hash table is split into shards by hash
+    // value, each with its own lock. Each shard also keeps its own free
+    // slots and lists of young and memoized nodes, so that interning a
+    // new node or storing a result only takes the lock of one shard. A
+    // separate lock is taken only when a shard runs out of free slots and
+    // grows the pool by a run of them. Nodes and memoized results are
+    // read without locking.
+    //
+    // Nodes interned since the last collection are young. Since children
+    // are always interned before their parents, an old node never refers
+    // to a young one, so a minor collection only needs to trace and sweep
+    // the young nodes. Collections must not run concurrently with anything
+    // else.
+
+    enum { OLD, YOUNG, FREE };
+
+    template<typename T>
+    class Level
+    {
+        static Index const TOMB = NONE - 1;
+
+        // The number of slots a shard takes from the pool at a time.
+        static size_t const RUN = 64;
+
+        struct Slot
+        {
+            T item;
+            std::atomic<Index> memo;
+            unsigned char state;
+        };
+
+        struct Shard
+        {
+            std::vector<Index> table;
+            size_t mask;
+            size_t used;
+            size_t tombs;
+            size_t lookups;
+            size_t hits;
+            size_t live;
+            size_t allocated;
+            std::vector<Index> young;
+            std::vector<Index> free;
+            std::vector<Index> memoized;
+            std::mutex lock;
+
+            Shard()
+                : table(64, NONE),
+                  mask(63),
+                  used(0),
+                  tombs(0),
+                  lookups(0),
+                  hits(0),
+                  live(0),
+                  allocated(0)
+            {
+            }
+        };
+
+        Pool<Slot> pool_;
+        std::vector<Shard*> shards_;
+        std::mutex lock_;
+        bool concurrent_;
+
+        Level(Level const&);
+        Level& operator=(Level const&);
+
+        Shard& shard(size_t const hash) const
+        {
+            return *shards_[(hash >> 40) & (shards_.size() - 1)];
+        }
+
+        void insert(Shard& s, Index const i)
+        {
+            size_t k = pool_[i].item.hash() & s.mask;
+            while (s.table[k] != NONE)
+                k = (k + 1) & s.mask;
+            s.table[k] = i;
+        }
+
+        void rehash(Shard& s)
+        {
+            size_t n = 64;
+            while (n < 4 * s.used)
+                n <<= 1;
+
+            std::vector<Index> old(n, NONE);
+            old.swap(s.table);
+            s.mask = s.table.size() - 1;
+            s.tombs = 0;
+
+            for (size_t i = 0; i < old.size(); ++i)
+                if (old.at(i) != NONE and old.at(i) != TOMB)
+                    insert(s, old.at(i));
+        }
+
+        // Takes a free slot for a new node. Must be called with the lock
+        // of the shard held.
+        Index allocate(Shard& s, T const& item)
+        {
+            if (s.free.empty())
+                refill(s);
+
+            Index const i = s.free.back();
+            s.free.pop_back();
+
+            Slot& slot = pool_[i];
+            slot.item = item;
+            slot.memo.store(NONE, std::memory_order_relaxed);
+            slot.state = YOUNG;
+
+            s.young.push_back(i);
+            ++s.live;
+            ++s.allocated;
+
+            return i;
+        }
 
-            if (n->extent == 2)
+        // Grows the pool by a run of free slots for the given shard.
+        void refill(Shard& s)
+        {
+            Guard guard(lock_, concurrent_);
+
+            Index const first = pool_.size();
+            for (size_t k = 0; k < RUN; ++k)
             {
-                h = h * 101 + n->se.val;
-                h = h * 101 + n->sw.val;
-                h = h * 101 + n->ne.val;
-                h = h * 101 + n->nw.val;
+                Index const i = pool_.push();
+                pool_[i].memo.store(NONE, std::memory_order_relaxed);
+                pool_[i].state = FREE;
             }
+            for (size_t k = RUN; k > 0; --k)
+                s.free.push_back(first + k - 1);
+        }
+
+        void remove(Index const i)
+        {
+            Shard& s = shard(pool_[i].item.hash());
+            size_t k = pool_[i].item.hash() & s.mask;
+            while (s.table[k] != i)
+                k = (k + 1) & s.mask;
+            s.table[k] = TOMB;
+            --s.used;
+            ++s.tombs;
+        }
+
+    public:
+        Level()
+            : shards_(1, new Shard()),
+              concurrent_(false)
+        {
+        }
+
+        ~Level()
+        {
+            for (size_t i = 0; i < shards_.size(); ++i)
+                delete shards_.at(i);
+        }
+
+        size_t size() const
+        {
+            size_t n = 0;
+            for (size_t i = 0; i < shards_.size(); ++i)
+                n += shards_.at(i)->live;
+            return n;
+        }
+
+        // The number of nodes ever allocated on this level, and the number
+        // of calls to intern(), of which hits found the node already there.
+        size_t allocated() const
+        {
+            size_t n = 0;
+            for (size_t i = 0; i < shards_.size(); ++i)
+                n += shards_.at(i)->allocated;
+            return n;
+        }
+
+        size_t lookups() const
+        {
+            size_t n = 0;
+            for (size_t i = 0; i < shards_.size(); ++i)
+                n += shards_.at(i)->lookups;
+            return n;
+        }
+
+        size_t hits() const
+        {
+            size_t n = 0;
+            for (size_t i = 0; i < shards_.size(); ++i)
+                n += shards_.at(i)->hits;
+            return n;
+        }
+
+        size_t bytes() const
+        {
+            size_t n = pool_.bytes();
+            for (size_t i = 0; i < shards_.size(); ++i)
+            {
+                Shard const& s = *shards_.at(i);
+                n += (s.table.size() + s.young.capacity() + s.free.capacity()
+                      + s.memoized.capacity()) * sizeof(Index);
+            }
+            return n;
+        }
+
+        size_t live_bytes() const
+        {
+            size_t n = 0;
+            for (size_t i = 0; i < shards_.size(); ++i)
+            {
+                Shard const& s = *shards_.at(i);
+                n += s.live * sizeof(Slot)
+                    + (s.table.size() + s.young.size() + s.memoized.size())
+                    * sizeof(Index);
+            }
+            return n;
+        }
+
+        T const& operator[](Index const i) const { return pool_[i].item; }
+
+        bool is_free(Index const i) const { return pool_[i].state == FREE; }
+
+        Index memo(Index const i) const
+        {
+            return pool_[i].memo.load(std::memory_order_acquire);
+        }
+
+        void set_memo(Index const i, Index const result)
+        {
+            pool_[i].memo.store(result, std::memory_order_release);
+
+            // Any shard will do for the list, as long as the same node
+            // tends to land in the same one.
+            Shard& s = *shards_[i & (shards_.size() - 1)];
+            Guard guard(s.lock, concurrent_);
+            s.memoized.push_back(i);
+        }
+
+        // Switches locking on or off and splits the hash table into the
+        // given number of shards, which must be a power of two. The free
+        // slots are dealt out evenly among the new shards.
+        void set_concurrency(bool const concurrent, size_t const count)
+        {
+            concurrent_ = concurrent;
+            if (concurrent)
+                pool_.reserve_all();
+
+            size_t const looked = lookups(), found = hits();
+            size_t const made = allocated();
+            std::vector<Index> memoized;
+            for (size_t i = 0; i < shards_.size(); ++i)
+            {
+                Shard const& s = *shards_.at(i);
+                memoized.insert(memoized.end(),
+                                s.memoized.begin(), s.memoized.end());
+                delete shards_.at(i);
+            }
+            shards_.clear();
+            for (size_t i = 0; i < count; ++i)
+                shards_.push_back(new Shard());
+            shards_.at(0)->lookups = looked;
+            shards_.at(0)->hits = found;
+            shards_.at(0)->allocated = made;
+
+            for (size_t i = 0; i < memoized.size(); ++i)
+                shards_[memoized.at(i) & (count - 1)]->memoized.push_back(
+                    memoized.at(i));
+
+            for (size_t i = pool_.size(); i > 0; --i)
+            {
+                Index const k = i - 1;
+                if (pool_[k].state == FREE)
+                {
+                    shards_[k & (count - 1)]->free.push_back(k);
+                    continue;
+                }
+
+                Shard& s = shard(pool_[k].item.hash());
+                ++s.used;
+                ++s.live;
+                if (pool_[k].state == YOUNG)
+                    s.young.push_back(k);
+                if (2 * s.used > s.table.size())
+                    rehash(s);
+                insert(s, k);
+            }
+        }
+
+        Index intern(T const& item)
+        {
+            size_t const h = item.hash();
+            Shard& s = shard(h);
+            Guard guard(s.lock, concurrent_);
+
+            ++s.lookups;
+            size_t k = h & s.mask;
+            size_t slot = s.table.size();
+
+            while (s.table[k] != NONE)
+            {
+                if (s.table[k] == TOMB)
+                {
+                    if (slot == s.table.size())
+                        slot = k;
+                }
+                else if (pool_[s.table[k]].item == item)
+                {
+                    ++s.hits;
+                    return s.table[k];
+                }
+                k = (k + 1) & s.mask;
+            }
+
+            if (slot == s.table.size())
+                slot = k;
             else
+                --s.tombs;
+
+            Index const i = allocate(s, item);
+            s.table[slot] = i;
+            ++s.used;
+            if (2 * (s.used + s.tombs) > s.table.size())
+                rehash(s);
+
+            return i;
+        }
+
+        // Drops memoized results that refer to freed nodes on the level
+        // below. Only results stored since the last collection can refer
+        // to young nodes, so unless the collection was a full one, only
+        // those need to be checked.
+        template<typename L>
+        void forget_freed(L const& below, bool const full)
+        {
+            if (full)
             {
-                h = h * 101 + (size_t)n->se.node.get();
-                h = h * 101 + (size_t)n->sw.node.get();
-                h = h * 101 + (size_t)n->ne.node.get();
-                h = h * 101 + (size_t)n->nw.node.get();
+                for (size_t i = 0; i < pool_.size(); ++i)
+                    forget_if_freed(i, below);
+            }
+
+            for (size_t k = 0; k < shards_.size(); ++k)
+            {
+                std::vector<Index>& memoized = shards_.at(k)->memoized;
+                if (not full)
+                    for (size_t j = 0; j < memoized.size(); ++j)
+                        forget_if_freed(memoized[j], below);
+                memoized.clear();
+            }
+        }
+
+        template<typename L>
+        void forget_if_freed(Index const i, L const& below)
+        {
+            Index const m = memo(i);
+            if (m != NONE and below.is_free(m))
+                pool_[i].memo.store(NONE, std::memory_order_relaxed);
+        }
+
+        // Marks a node as reachable. Returns false if it was already
+        // marked or is old, in which case its children need no visit.
+        bool mark(Index const i)
+        {
+            if (pool_[i].state != YOUNG)
+                return false;
+            pool_[i].state = OLD;
+            return true;
+        }
+
+        // Frees all young nodes that were not marked and promotes the
+        // others. Returns the number of freed nodes.
+        size_t sweep()
+        {
+            size_t freed = 0;
+
+            for (size_t k = 0; k < shards_.size(); ++k)
+            {
+                Shard& s = *shards_.at(k);
+                for (size_t j = 0; j < s.young.size(); ++j)
+                {
+                    Index const i = s.young[j];
+                    if (pool_[i].state == YOUNG)
+                    {
+                        remove(i);
+                        pool_[i].state = FREE;
+                        s.free.push_back(i);
+                        --s.live;
+                        ++freed;
+                    }
+                }
+                s.young.clear();
+
+                if (4 * s.tombs > s.table.size())
+                    rehash(s);
+            }
+
+            return freed;
+        }
+
+        // Makes every live node young again, so that the next sweep
+        // considers the whole level.
+        void rejuvenate()
+        {
+            for (size_t k = 0; k < shards_.size(); ++k)
+                shards_.at(k)->young.clear();
+
+            for (size_t i = 0; i < pool_.size(); ++i)
+            {
+                if (pool_[i].state != FREE)
+                {
+                    pool_[i].state = YOUNG;
+                    shard(pool_[i].item.hash()).young.push_back(i);
+                }
             }
-            return h;
         }
     };
 
-    struct Equal
+    // The shared part of a cache. Level 0 holds the leaves, level h holds
+    // squares of extent LEAF_SIZE << h. There is one level above the
+    // root for the padded squares that advance() works on, and empty[h]
+    // is the square at level h that holds only the filler value.
+
+    struct Store
     {
-        bool operator()(NodePtr n, NodePtr m) const
+        ValueType filler;
+        size_t width, height, depth, extent;
+        Level<Leaf> leaves;
+        std::vector<Level<Node>*> nodes;
+        std::vector<Index> empty;
+
+        size_t limit;
+        size_t threshold;
+        size_t collections;
+        size_t reclaimed;
+        size_t reclaimed_bytes;
+
+        Store()
+            : limit(0),
+              threshold(0),
+              collections(0),
+              reclaimed(0),
+              reclaimed_bytes(0)
         {
-            if (n->extent != m->extent)
-                return false;
+        }
+
+        ~Store()
+        {
+            for (size_t i = 0; i < nodes.size(); ++i)
+                delete nodes.at(i);
+        }
+
+        Index make_leaf(Leaf const& leaf)
+        {
+            return leaves.intern(leaf);
+        }
+
+        Index make_node(size_t const h, Index const se, Index const sw,
+                        Index const ne, Index const nw)
+        {
+            Node const node = {{ se, sw, ne, nw }};
+            return nodes.at(h)->intern(node);
+        }
+
+        ValueType find(Index node, size_t const x, size_t const y) const
+        {
+            if (x >= extent or y >= extent)
+                return filler;
+
+            for (size_t h = depth - 1; h > 0; --h)
+                node = (*nodes[h])[node].child[quadrant(h, x, y)];
+
+            return leaves[node].val[cell(x, y)];
+        }
+
+        Index set(Index const node, size_t const h,
+                  size_t const x, size_t const y, ValueType const val)
+        {
+            if (h == 0)
+            {
+                Leaf leaf = leaves[node];
+                leaf.val[cell(x, y)] = val;
+                return leaves.intern(leaf);
+            }
+            else
+            {
+                size_t const q = quadrant(h, x, y);
+                Node next = (*nodes[h])[node];
+                next.child[q] = set(next.child[q], h-1, x, y, val);
+                return nodes[h]->intern(next);
+            }
+        }
+
+        // Applies a run of updates that all lie within the given node and
+        // are sorted by z_less(), so that those in the same quadrant at
+        // each level are adjacent. Every node on the way is copied and
+        // interned once, however many updates go through it.
+        Index set_many(Index const node, size_t const h,
+                       Update const* begin, Update const* const end)
+        {
+            if (h == 0)
+            {
+                Leaf leaf = leaves[node];
+                for (; begin != end; ++begin)
+                    leaf.val[cell(begin->x, begin->y)] = begin->value;
+                return leaves.intern(leaf);
+            }
+            else
+            {
+                Node next = (*nodes[h])[node];
+                while (begin != end)
+                {
+                    size_t const q = quadrant(h, begin->x, begin->y);
+                    Update const* stop = begin + 1;
+                    while (stop != end and
+                           quadrant(h, stop->x, stop->y) == q)
+                        ++stop;
+                    next.child[q] = set_many(next.child[q], h-1, begin, stop);
+                    begin = stop;
+                }
+                return nodes[h]->intern(next);
+            }
+        }
+
+        size_t bytes() const
+        {
+            size_t n = leaves.bytes();
+            for (size_t h = 1; h < nodes.size(); ++h)
+                n += nodes.at(h)->bytes();
+            return n;
+        }
+
+        size_t live_bytes() const
+        {
+            size_t n = leaves.live_bytes();
+            for (size_t h = 1; h < nodes.size(); ++h)
+                n += nodes.at(h)->live_bytes();
+            return n;
+        }
+
+        void mark(Index const node, size_t const h)
+        {
+            if (h == 0)
+                leaves.mark(node);
+            else if (nodes[h]->mark(node))
+                for (int i = 0; i < 4; ++i)
+                    mark((*nodes[h])[node].child[i], h-1);
+        }
+
+        size_t sweep(bool const full)
+        {
+            size_t freed = leaves.sweep();
+            for (size_t h = 1; h < nodes.size(); ++h)
+                freed += nodes.at(h)->sweep();
+            nodes.at(1)->forget_freed(leaves, full);
+            for (size_t h = 2; h < nodes.size(); ++h)
+                nodes.at(h)->forget_freed(*nodes.at(h-1), full);
+            return freed;
+        }
+
+        Index child(size_t const h, Index const node, size_t const q) const
+        {
+            return (*nodes[h])[node].child[q];
+        }
+
+        // The square at level h-1 in the middle of the given one.
+        Index centre(size_t const h, Index const node)
+        {
+            Node const n = (*nodes[h])[node];
+
+            if (h == 1)
+            {
+                size_t const o = LEAF_SIZE / 2;
+                Leaf leaf;
+                for (size_t y = o; y < o + LEAF_SIZE; ++y)
+                    for (size_t x = o; x < o + LEAF_SIZE; ++x)
+                        leaf.val[cell(x - o, y - o)] =
+                            leaves[n.child[quadrant(1, x, y)]].val[cell(x, y)];
+                return make_leaf(leaf);
+            }
+            else
+                return make_node(h-1,
+                                 child(h-1, n.child[0], 3),
+                                 child(h-1, n.child[1], 2),
+                                 child(h-1, n.child[2], 1),
+                                 child(h-1, n.child[3], 0));
+        }
+
+        // Copies the contents of a square into a dense array with the
+        // given row stride.
+        void extract(Index const node, size_t const h, ValueType* out,
+                     size_t const stride) const
+        {
+            if (h == 0)
+            {
+                Leaf const& leaf = leaves[node];
+                for (size_t y = 0; y < LEAF_SIZE; ++y)
+                    std::copy(leaf.val + y * LEAF_SIZE,
+                              leaf.val + (y + 1) * LEAF_SIZE,
+                              out + y * stride);
+            }
+            else
+            {
+                size_t const e = LEAF_SIZE << (h-1);
+                Node const& n = (*nodes[h])[node];
+                extract(n.child[0], h-1, out,                  stride);
+                extract(n.child[1], h-1, out + e,              stride);
+                extract(n.child[2], h-1, out + e * stride,     stride);
+                extract(n.child[3], h-1, out + e * stride + e, stride);
+            }
+        }
+
+        // Builds a square at level h from a dense array.
+        Index pack(ValueType const* in, size_t const h, size_t const stride)
+        {
+            if (h == 0)
+            {
+                Leaf leaf;
+                for (size_t y = 0; y < LEAF_SIZE; ++y)
+                    std::copy(in + y * stride, in + y * stride + LEAF_SIZE,
+                              leaf.val + y * LEAF_SIZE);
+                return make_leaf(leaf);
+            }
+            else
+            {
+                size_t const e = LEAF_SIZE << (h-1);
+                return make_node(h,
+                                 pack(in,                  h-1, stride),
+                                 pack(in + e,              h-1, stride),
+                                 pack(in + e * stride,     h-1, stride),
+                                 pack(in + e * stride + e, h-1, stride));
+            }
+        }
+
+        // Computes the centre of a square at level h >= 1 after one
+        // application of the rule, as a square at level h-1. Results are
+        // memoized per node, and larger squares are assembled from the
+        // results for overlapping squares one level down, as in Gosper's
+        // Hashlife. The smallest squares handed to the rule directly are
+        // those with extent 8, or the ones at level 1 for larger tiles.
+        template<typename Rule>
+        Index advance(Index const node, size_t const h, Rule const& rule)
+        {
+            Index result = nodes[h]->memo(node);
+            if (result != NONE)
+                return result;
+
+            size_t const n = LEAF_SIZE << h;
+
+            if (h == 1 or n <= 8)
+            {
+                ValueType in[BASE_CELLS], out[BASE_CELLS / 4];
+                extract(node, h, in, n);
+                rule(in, n, out);
+                result = pack(out, h-1, n / 2);
+            }
+            else
+            {
+                Index g[4][4];
+                for (size_t r = 0; r < 4; ++r)
+                    for (size_t c = 0; c < 4; ++c)
+                        g[r][c] = child(h-1, child(h, node, r/2*2 + c/2),
+                                        r%2*2 + c%2);
+
+                Index m[3][3];
+                for (size_t r = 0; r < 3; ++r)
+                    for (size_t c = 0; c < 3; ++c)
+                        m[r][c] = centre(h-1, make_node(h-1,
+                                                        g[r  ][c], g[r  ][c+1],
+                                                        g[r+1][c], g[r+1][c+1]));
+
+                Index q[2][2];
+                for (size_t r = 0; r < 2; ++r)
+                    for (size_t c = 0; c < 2; ++c)
+                        q[r][c] = advance(make_node(h-1,
+                                                    m[r  ][c], m[r  ][c+1],
+                                                    m[r+1][c], m[r+1][c+1]),
+                                          h-1, rule);
 
-            if (n->extent == 2)
-                return (n->se.val == m->se.val and
-                        n->sw.val == m->sw.val and
-                        n->ne.val == m->ne.val and
-                        n->nw.val == m->nw.val);
+                result = make_node(h-1, q[0][0], q[0][1], q[1][0], q[1][1]);
+            }
+
+            nodes[h]->set_memo(node, result);
+            return result;
+        }
+
+        // Calls f(x, y) for every cell in which two squares differ. Shared
+        // subsquares are skipped, so this takes time proportional to the
+        // number of differences.
+        template<typename F>
+        void diff(Index const a, Index const b, size_t const h,
+                  size_t const x0, size_t const y0, F& f) const
+        {
+            if (a == b)
+                return;
+
+            if (h == 0)
+            {
+                for (size_t i = 0; i < LEAF_CELLS; ++i)
+                    if (leaves[a].val[i] != leaves[b].val[i])
+                        f(x0 + i % LEAF_SIZE, y0 + i / LEAF_SIZE);
+            }
+            else
+            {
+                size_t const e = LEAF_SIZE << (h-1);
+                for (size_t q = 0; q < 4; ++q)
+                    diff(child(h, a, q), child(h, b, q), h-1,
+                         x0 + q % 2 * e, y0 + q / 2 * e, f);
+            }
+        }
+
+        // Surrounds a root with filler, so that the root becomes the centre
+        // of a square one level up.
+        Index pad(Index const root)
+        {
+            size_t const h = depth - 1;
+            Index const e = empty.at(h - 1);
+            Node const& n = (*nodes[h])[root];
+
+            return make_node(h + 1,
+                             make_node(h, e, e, e, n.child[0]),
+                             make_node(h, e, e, n.child[1], e),
+                             make_node(h, e, n.child[2], e, e),
+                             make_node(h, n.child[3], e, e, e));
+        }
+
+        void rejuvenate()
+        {
+            leaves.rejuvenate();
+            for (size_t h = 1; h < nodes.size(); ++h)
+                nodes.at(h)->rejuvenate();
+        }
+
+        void set_concurrency(bool const concurrent, size_t const shards)
+        {
+            leaves.set_concurrency(concurrent, shards);
+            for (size_t h = 1; h < nodes.size(); ++h)
+                nodes.at(h)->set_concurrency(concurrent, shards);
+        }
+
+        // The number of cells in the largest square handed to a rule.
+        static size_t const BASE_CELLS =
+            LEAF_SIZE < 8 ? 64 : 4 * LEAF_CELLS;
+
+        // The quadrant of a node at level h >= 1 that holds (x, y).
+        static size_t quadrant(size_t const h, size_t const x, size_t const y)
+        {
+            size_t const b = h - 1 + LEAF_BITS;
+            return ((y >> b) & 1) * 2 + ((x >> b) & 1);
+        }
+
+        // The position of (x, y) within its leaf.
+        static size_t cell(size_t const x, size_t const y)
+        {
+            return (y % LEAF_SIZE) * LEAF_SIZE + x % LEAF_SIZE;
+        }
+
+        // Compares cells in the order of their quadrant numbers from the
+        // top level down, without interleaving the bits of x and y.
+        static bool z_less(Update const& a, Update const& b)
+        {
+            size_t const dx = a.x ^ b.x, dy = a.y ^ b.y;
+
+            if (dy < dx and dy < (dx ^ dy))
+                return a.x < b.x;
             else
-                return (n->se.node == m->se.node and
-                        n->sw.node == m->sw.node and
-                        n->ne.node == m->ne.node and
-                        n->nw.node == m->nw.node);
+                return a.y < b.y;
         }
     };
 
@@ -90,204 +957,569 @@ public:
         {
             std::size_t operator()(Map const m) const
             {
-                return Hash()(m.root_);
+                return m.root_ * 0x9e3779b97f4a7c15ull;
             }
         };
 
         struct MEqual
         {
-            std::size_t operator()(Map const m, Map const o) const
+            bool operator()(Map const m, Map const o) const
+            {
+                return m.root_ == o.root_;
+            }
+        };
+
+        struct OutOfRange
+        {
+            size_t extent;
+
+            explicit OutOfRange(size_t const e) : extent(e) {}
+
+            bool operator()(Update const& u) const
             {
-                return Equal()(m.root_, o.root_);
+                return u.x >= extent or u.y >= extent;
             }
         };
 
     public:
+        typedef MHash Hash;
+        typedef MEqual Equal;
         typedef std::unordered_set<Map, MHash, MEqual> Set;
-        
+
         Map()
+            : store_(0),
+              root_(NONE)
         {
         }
 
         ValueType at(size_t const x, size_t const y) const
         {
-            return parent_.find(root_, 0, parent_.extent_, x, y);
+            return store_->find(root_, x, y);
         }
 
-        Map set(size_t const x, size_t const y, ValueType val)
+        Map set(size_t const x, size_t const y, ValueType val) const
         {
-            return Map(parent_,
-                       parent_.set(root_, 0, parent_.extent_, x, y, val));
+            if (x >= store_->extent or y >= store_->extent)
+                return *this;
+            else
+                return Map(store_,
+                           store_->set(root_, store_->depth - 1, x, y, val));
         }
 
+        // Sets several cells at once, sharing the work on the nodes above
+        // them. If a cell appears more than once, the last update wins.
+        // The updates are reordered in the process.
+        Map set_many(std::vector<Update>& updates) const
+        {
+            updates.erase(std::remove_if(updates.begin(), updates.end(),
+                                         OutOfRange(store_->extent)),
+                          updates.end());
+            if (updates.empty())
+                return *this;
+
+            // Batches are usually a handful of cells, for which a plain
+            // insertion sort beats allocating a merge buffer.
+            if (updates.size() <= 32)
+                for (size_t i = 1; i < updates.size(); ++i)
+                    for (size_t j = i; j > 0 and
+                             Store::z_less(updates[j], updates[j-1]); --j)
+                        std::swap(updates[j], updates[j-1]);
+            else
+                std::stable_sort(updates.begin(), updates.end(),
+                                 Store::z_less);
+
+            return Map(store_, store_->set_many(root_, store_->depth - 1,
+                                                &updates[0],
+                                                &updates[0] + updates.size()));
+        }
+
+        // Applies a cellular automaton rule once to the whole map. The
+        // rule is called as rule(in, n, out) with in an n by n array, where
+        // n is 8 or twice the leaf size, whichever is larger, and must
+        // write the new contents of the central n/2 by n/2 square to out,
+        // so it may look up to two cells away. Results are memoized in the cache
+        // and reused by later calls, so every call on the same cache must
+        // use the same rule. The area around the map counts as filled
+        // with the filler value.
+        template<typename Rule>
+        Map advance(Rule const& rule) const
+        {
+            return Map(store_, store_->advance(store_->pad(root_),
+                                               store_->depth, rule));
+        }
+
+        // Calls f(x, y) for every cell in which this map differs from
+        // the other one, which must come from the same cache.
+        template<typename F>
+        void diff(Map const other, F& f) const
+        {
+            store_->diff(root_, other.root_, store_->depth - 1, 0, 0, f);
+        }
+
+        Index root() const { return root_; }
+
+        bool operator==(Map const other) const
+        {
+            return root_ == other.root_;
+        }
+
+        bool operator!=(Map const other) const
+        {
+            return root_ != other.root_;
+        }
+
+        // Reads a row of a map from left to right. The path from the root
+        // to the current leaf is kept, so reading a whole row takes time
+        // proportional to its length plus the depth of the tree, rather
+        // than a descent from the root for every cell.
+        class Cursor
+        {
+        public:
+            Cursor(Map const& map, size_t const y)
+                : store_(map.store_),
+                  path_(map.store_->depth),
+                  leaf_(0),
+                  x_(0),
+                  y_(y)
+            {
+                path_.back() = map.root_;
+                descend(path_.size() - 1);
+            }
+
+            size_t x() const { return x_; }
+
+            ValueType operator*() const
+            {
+                if (x_ >= store_->extent or y_ >= store_->extent)
+                    return store_->filler;
+                else
+                    return leaf_->val[Store::cell(x_, y_)];
+            }
+
+            Cursor& operator++()
+            {
+                ++x_;
+                if (x_ % LEAF_SIZE == 0 and x_ < store_->extent)
+                {
+                    size_t h = 1;
+                    while (x_ % (LEAF_SIZE << h) == 0)
+                        ++h;
+                    descend(h);
+                }
+                return *this;
+            }
+
+        private:
+            Store const* store_;
+            std::vector<Index> path_;
+            Leaf const* leaf_;
+            size_t x_, y_;
+
+            // Follows the current position down from the node at level h.
+            void descend(size_t const h)
+            {
+                if (y_ >= store_->extent)
+                    return;
+
+                for (size_t k = h; k > 0; --k)
+                    path_[k-1] = store_->child(k, path_[k],
+                                               Store::quadrant(k, x_, y_));
+                leaf_ = &store_->leaves[path_[0]];
+            }
+        };
+
     private:
         friend class QuadCache;
 
-        QuadCache parent_;
-        NodePtr root_;
+        Store* store_;
+        Index root_;
 
-        Map(QuadCache parent, NodePtr const root)
-            : parent_(parent),
+        Map(Store* store, Index const root)
+            : store_(store),
               root_(root)
         {
         }
     };
 
-    typedef std::unordered_set<NodePtr, Hash, Equal> Bucket;
-    typedef std::tr1::shared_ptr<std::vector<Bucket> > BucketList;
-
     QuadCache()
     {
     }
 
-    explicit QuadCache(std::vector<std::vector<ValueType> > const& data,
-                       ValueType const filler)
+    // Builds the tree bottom-up, one band of LEAF_SIZE rows at a time, so
+    // that the grid as a whole is never held in memory. Each band becomes
+    // a row of leaves, and two rows of nodes on one level are merged into
+    // a row on the next as soon as both are there. The caller supplies
+    // the rows as rows(y, out), which must write the width values of row
+    // y to out and is called once for each row, in increasing order of y.
+    template<typename Rows>
+    QuadCache(size_t const width, size_t const height, Rows& rows,
+              ValueType const filler)
+        : store_(new Store())
     {
-        filler_ = filler;
-        height_ = data.size();
-        width_ = 0;
-        for (size_t i = 0; i < height_; ++i)
-            width_ = std::max(width_, data.at(i).size());
+        Store& s = *store_;
+
+        s.filler = filler;
+        s.height = height;
+        s.width = width;
+
+        s.depth = 2;
+        s.extent = 2 * LEAF_SIZE;
+        while (s.extent < s.height or s.extent < s.width)
+        {
+            ++s.depth;
+            s.extent <<= 1;
+        }
+
+        s.nodes.push_back(0);
+        for (size_t h = 1; h <= s.depth; ++h)
+            s.nodes.push_back(new Level<Node>());
 
-        depth_ = 1;
-        extent_ = 2;
-        while (extent_ < height_ or extent_ < width_)
+        Leaf blank;
+        std::fill(blank.val, blank.val + LEAF_CELLS, filler);
+        s.empty.push_back(s.make_leaf(blank));
+        for (size_t h = 1; h < s.depth; ++h)
         {
-            ++depth_;
-            extent_ <<= 1;
+            Index const e = s.empty.back();
+            s.empty.push_back(s.make_node(h, e, e, e, e));
+        }
+
+        size_t const columns = s.extent / LEAF_SIZE;
+        std::vector<ValueType> band(LEAF_SIZE * columns * LEAF_SIZE, filler);
+        std::vector<std::vector<Index> > waiting(s.depth);
+
+        for (size_t y0 = 0; y0 < s.extent; y0 += LEAF_SIZE)
+        {
+            std::vector<Index> row(columns, s.empty.at(0));
+
+            if (y0 < height)
+            {
+                size_t const stride = columns * LEAF_SIZE;
+                for (size_t y = 0; y < LEAF_SIZE; ++y)
+                    if (y0 + y < height)
+                        rows(y0 + y, &band.at(y * stride));
+                    else
+                        std::fill(&band.at(y * stride),
+                                  &band.at(y * stride) + width, filler);
+
+                for (size_t c = 0; c * LEAF_SIZE < width; ++c)
+                {
+                    Leaf leaf;
+                    for (size_t y = 0; y < LEAF_SIZE; ++y)
+                        std::copy(&band.at(y * stride + c * LEAF_SIZE),
+                                  &band.at(y * stride + c * LEAF_SIZE)
+                                  + LEAF_SIZE,
+                                  leaf.val + y * LEAF_SIZE);
+                    row.at(c) = s.make_leaf(leaf);
+                }
+            }
+
+            size_t h = 0;
+            while (not waiting.at(h).empty())
+            {
+                std::vector<Index> const& below = waiting.at(h);
+                std::vector<Index> merged(row.size() / 2);
+                for (size_t i = 0; i < merged.size(); ++i)
+                    merged.at(i) = s.make_node(h + 1,
+                                               below.at(2 * i),
+                                               below.at(2 * i + 1),
+                                               row.at(2 * i),
+                                               row.at(2 * i + 1));
+                waiting.at(h).clear();
+                row.swap(merged);
+                ++h;
+            }
+            waiting.at(h).swap(row);
         }
 
-        buckets_ = BucketList(new std::vector<Bucket>(depth_));
-        original_ = build(data, 0, extent_, 0, 0);
+        original_ = waiting.at(s.depth - 1).at(0);
     }
 
     Map original()
     {
-        return Map(*this, original_);
+        return Map(store_.get(), original_);
     }
 
-    void info() const
+    // Prepares the cache for use by the given number of threads. Until
+    // the next call, maps may be read, set and advanced concurrently, but
+    // collect() must only be called while no other thread uses the cache.
+    void set_threads(size_t const threads)
     {
-        for (size_t i = 0; i < depth_; ++i)
-            std::cerr << buckets_->at(i).size() << " squares at level " << i
-                      << std::endl;
+        size_t shards = 1;
+        while (threads > 1 and shards < 4 * threads)
+            shards <<= 1;
+        store_->set_concurrency(threads > 1, shards);
     }
 
-private:
-    ValueType filler_;
-    size_t width_;
-    size_t height_;
-    size_t depth_;
-    size_t extent_;
-    BucketList buckets_;
-    NodePtr original_;
-
-    ValueType get(std::vector<std::vector<ValueType> > const& data,
-                  size_t const x, size_t const y) const
+    // Sets the number of bytes the live nodes may occupy before
+    // needs_collection() reports true. A limit of zero means no limit.
+    // If the reachable nodes alone exceed the limit, the threshold for
+    // the next collection is raised to twice their size.
+    void set_memory_limit(size_t const bytes)
     {
-        if (y >= height_)
-            return filler_;
-        else
-        {
-            std::vector<ValueType> const& row = data.at(y);
-            return x >= row.size() ? filler_ : row.at(x);
-        }
+        store_->limit = store_->threshold = bytes;
     }
 
-    NodePtr canonical(NodePtr node, size_t const level)
+    bool needs_collection() const
     {
-        if (level == 0)
-            return node;
-        else
-        {
-            std::pair<typename Bucket::iterator, bool> result =
-                buckets_->at(level).insert(node);
+        return store_->limit > 0 and store_->live_bytes() > store_->threshold;
+    }
 
-            if (result.second)
-                return node;
-            else
-                return *result.first;
+    // The number of bytes taken by live nodes, and by all nodes including
+    // the free slots kept for reuse.
+    size_t live_bytes() const
+    {
+        return store_->live_bytes();
+    }
+
+    size_t bytes() const
+    {
+        return store_->bytes();
+    }
+
+    // The number of bytes a map takes beyond the nodes it shares with
+    // other maps in the cache, which is none.
+    size_t map_bytes(Map const) const
+    {
+        return 0;
+    }
+
+    // Frees all nodes that are not reachable from the given roots. Tries
+    // a minor collection of the nodes created since the last call first
+    // and falls back to a full one if that does not bring the store well
+    // below its limit. Maps that are not among the roots are invalid
+    // afterwards. Returns the number of nodes freed.
+    size_t collect(std::vector<Map> const& roots)
+    {
+        Store& s = *store_;
+        size_t const before = s.live_bytes();
+
+        size_t freed = mark_and_sweep(roots, false);
+        if (s.limit > 0 and 4 * s.live_bytes() > 3 * s.limit)
+        {
+            s.rejuvenate();
+            freed += mark_and_sweep(roots, true);
         }
+
+        s.threshold = std::max(s.limit, 2 * s.live_bytes());
+        ++s.collections;
+        s.reclaimed += freed;
+        s.reclaimed_bytes += before - std::min(before, s.live_bytes());
+
+        return freed;
     }
 
-    NodePtr build(std::vector<std::vector<ValueType> > const& data,
-                size_t const level, size_t const extent,
-                size_t const x0, size_t const y0)
+    void info() const
     {
-        Entry se, sw, ne, nw;
-        if (extent == 2)
+        Store const& s = *store_;
+
+        for (size_t i = 0; i < s.depth; ++i)
         {
-            se.val = get(data, x0  , y0  );
-            sw.val = get(data, x0+1, y0  );
-            ne.val = get(data, x0  , y0+1);
-            nw.val = get(data, x0+1, y0+1);
+            size_t const h = s.depth - 1 - i;
+            size_t const n = h == 0 ? s.leaves.size() : s.nodes.at(h)->size();
+            std::cerr << n << " squares at level " << i << std::endl;
         }
-        else
+        std::cerr << s.bytes() << " bytes in node store, "
+                  << s.live_bytes() << " in use" << std::endl;
+        if (s.collections > 0)
+            std::cerr << s.reclaimed << " squares (" << s.reclaimed_bytes
+                      << " bytes) reclaimed in " << s.collections
+                      << " collections" << std::endl;
+    }
+
+    // Writes the squares of the given maps, each distinct one once, level
+    // by level from the leaves up, with children given by their position
+    // on the level below, and then the roots of the maps. Out must
+    // provide put(value) and put_bytes(data, n), as BinaryWriter does.
+    template<typename Out>
+    void save(std::vector<Map> const& maps, Out& out) const
+    {
+        Store const& s = *store_;
+        Numbering numbering(s.depth);
+
+        for (size_t i = 0; i < maps.size(); ++i)
+            number(numbering, maps.at(i).root_, s.depth - 1);
+
+        out.put(std::uint32_t(s.depth));
+        for (size_t h = 0; h < s.depth; ++h)
         {
-            size_t const e = extent >> 1;
-            se.node = build(data, level+1, e, x0  , y0  );
-            sw.node = build(data, level+1, e, x0+e, y0  );
-            ne.node = build(data, level+1, e, x0  , y0+e);
-            nw.node = build(data, level+1, e, x0+e, y0+e);
+            std::vector<Index> const& order = numbering.at(h).order;
+            out.put(std::uint64_t(order.size()));
+
+            for (size_t i = 0; i < order.size(); ++i)
+            {
+                if (h == 0)
+                    out.put_bytes(s.leaves[order.at(i)].val,
+                                  sizeof(ValueType) * LEAF_CELLS);
+                else
+                {
+                    Node const& node = (*s.nodes.at(h))[order.at(i)];
+                    for (size_t k = 0; k < 4; ++k)
+                        out.put(numbering.at(h - 1).ids[node.child[k]]);
+                }
+            }
         }
 
-        return canonical(NodePtr(new Node({ extent, se, sw, ne, nw })), level);
+        out.put(std::uint64_t(maps.size()));
+        for (size_t i = 0; i < maps.size(); ++i)
+            out.put(numbering.at(s.depth - 1).ids[maps.at(i).root_]);
     }
 
-    ValueType find(NodePtr node,
-                   size_t const level, size_t const extent,
-                   size_t const x, size_t const y) const
+    // Reads maps written by save() into this cache, interning every
+    // square, and appends them to maps. The cache must be for a grid of
+    // the same size. In must provide get<T>(), count<T>(each) and
+    // bytes(n), as BinaryReader does.
+    template<typename In>
+    void load(In& in, std::vector<Map>& maps)
     {
-        size_t const e = extent >> 1;
-        Entry entry;
-
-        if (y < e)
-            entry = (x < e) ? node->se : node->sw;
-        else
-            entry = (x < e) ? node->ne : node->nw;
-
-        if (extent == 2)
-            return entry.val;
-        else
-            return find(entry.node, level+1, e, x % e, y % e);
+        Store& s = *store_;
+
+        if (in.template get<std::uint32_t>() != s.depth)
+            throw "Saved maps do not fit this cache.";
+
+        std::vector<Index> below, level;
+        for (size_t h = 0; h < s.depth; ++h)
+        {
+            level.resize(in.template count<std::uint64_t>(
+                             h == 0 ? sizeof(ValueType) * LEAF_CELLS
+                                    : 4 * sizeof(Index)));
+
+            for (size_t i = 0; i < level.size(); ++i)
+            {
+                if (h == 0)
+                {
+                    Leaf leaf;
+                    std::memcpy(leaf.val,
+                                in.bytes(sizeof(ValueType) * LEAF_CELLS),
+                                sizeof(ValueType) * LEAF_CELLS);
+                    level.at(i) = s.make_leaf(leaf);
+                }
+                else
+                {
+                    Index child[4];
+                    for (size_t k = 0; k < 4; ++k)
+                        child[k] = below.at(in.template get<Index>());
+                    level.at(i) = s.make_node(h, child[0], child[1],
+                                              child[2], child[3]);
+                }
+            }
+            below.swap(level);
+        }
+
+        size_t const n = in.template count<std::uint64_t>(sizeof(Index));
+        for (size_t i = 0; i < n; ++i)
+            maps.push_back(Map(store_.get(),
+                               below.at(in.template get<Index>())));
     }
 
-    NodePtr set(NodePtr node,
-                size_t const level, size_t const extent,
-                size_t const x, size_t const y, ValueType const val)
+    // Writes the state of the store and what it has done so far, with a
+    // list of levels from the root down, as members of a JSON object.
+    void counters(Json& json) const
     {
-        size_t const e = extent >> 1;
-        NodePtr result(new Node({ node->extent,
-                        node->se, node->sw, node->ne, node->nw }));
-        Entry entry;
-
-        if (y < e)
-            entry = (x < e) ? node->se : node->sw;
-        else
-            entry = (x < e) ? node->ne : node->nw;
+        Store const& s = *store_;
 
-        if (extent == 2)
-            entry.val = val;
-        else
-            entry.node = set(entry.node, level+1, e, x % e, y % e, val);
+        json.member("kind", "quad")
+            .member("width", s.width)
+            .member("height", s.height)
+            .member("bytes", s.bytes())
+            .member("live_bytes", s.live_bytes())
+            .member("collections", s.collections)
+            .member("reclaimed", s.reclaimed);
 
-        if (y < e)
+        std::ostream& out = json.key("levels") << '[';
+        for (size_t i = 0; i < s.depth; ++i)
         {
-            if (x < e)
-                result->se = entry;
+            size_t const h = s.depth - 1 - i;
+            size_t nodes, allocated, lookups, hits;
+            if (h == 0)
+            {
+                nodes = s.leaves.size();
+                allocated = s.leaves.allocated();
+                lookups = s.leaves.lookups();
+                hits = s.leaves.hits();
+            }
             else
-                result->sw = entry;
+            {
+                nodes = s.nodes.at(h)->size();
+                allocated = s.nodes.at(h)->allocated();
+                lookups = s.nodes.at(h)->lookups();
+                hits = s.nodes.at(h)->hits();
+            }
+
+            if (i > 0)
+                out << ',';
+            Json level(out);
+            level.member("level", i)
+                .member("nodes", nodes)
+                .member("allocated", allocated)
+                .member("lookups", lookups)
+                .member("hits", hits)
+                .member("hit_ratio", ratio(hits, lookups));
         }
-        else
+        out << ']';
+    }
+
+private:
+    std::tr1::shared_ptr<Store> store_;
+    Index original_;
+
+    // The squares on one level that save() writes, in order, and their
+    // positions in that order.
+    struct Numbered
+    {
+        std::unordered_map<Index, Index> ids;
+        std::vector<Index> order;
+    };
+
+    typedef std::vector<Numbered> Numbering;
+
+    Index number(Numbering& numbering, Index const node, size_t const h) const
+    {
+        Numbered& level = numbering.at(h);
+
+        typename std::unordered_map<Index, Index>::const_iterator const i =
+            level.ids.find(node);
+        if (i != level.ids.end())
+            return i->second;
+
+        if (h > 0)
         {
-            if (x < e)
-                result->ne = entry;
-            else
-                result->nw = entry;
+            Node const& n = (*store_->nodes.at(h))[node];
+            for (size_t k = 0; k < 4; ++k)
+                number(numbering, n.child[k], h - 1);
         }
 
-        return canonical(result, level);
+        Index const id = level.order.size();
+        level.order.push_back(node);
+        level.ids[node] = id;
+        return id;
+    }
+
+    size_t mark_and_sweep(std::vector<Map> const& roots, bool const full)
+    {
+        Store& s = *store_;
+
+        s.mark(original_, s.depth - 1);
+        s.mark(s.empty.back(), s.depth - 1);
+        for (size_t i = 0; i < roots.size(); ++i)
+            s.mark(roots.at(i).root_, s.depth - 1);
+
+        return s.sweep(full);
     }
 };
 
+template<typename ValueType, size_t LEAF_BITS>
+typename QuadCache<ValueType, LEAF_BITS>::Index const
+QuadCache<ValueType, LEAF_BITS>::NONE;
+
+template<typename ValueType, size_t LEAF_BITS>
+size_t const QuadCache<ValueType, LEAF_BITS>::LEAF_SIZE;
+
+template<typename ValueType, size_t LEAF_BITS>
+size_t const QuadCache<ValueType, LEAF_BITS>::LEAF_CELLS;
+
+template<typename ValueType, size_t LEAF_BITS>
+template<typename T>
+typename QuadCache<ValueType, LEAF_BITS>::Index const
+QuadCache<ValueType, LEAF_BITS>::Level<T>::TOMB;
+
 #endif
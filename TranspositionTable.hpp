@@ -0,0 +1,138 @@
+/** -*-c++-*-
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ *  File: TranspositionTable.hpp
+ *  Project: lambdaminer (potential ICFP 2012 contest entry)
+ *  Date: 2012-07-16
+ *
+ *  An open addressing hash table from 64-bit state keys to small values.
+ *
+ */
+
+#ifndef LAMBDAMINER_TRANSPOSITIONTABLE_HPP
+#define LAMBDAMINER_TRANSPOSITIONTABLE_HPP 1
+
+#include <cstdint>
+#include <vector>
+
+using std::size_t;
+
+template<typename Value>
+class TranspositionTable
+{
+public:
+    struct Entry
+    {
+        std::uint64_t key;
+        Value value;
+    };
+
+    TranspositionTable()
+        : table_(1024),
+          mask_(1023),
+          size_(0)
+    {
+    }
+
+    size_t size() const { return size_; }
+
+    size_t bytes() const { return table_.size() * sizeof(Entry); }
+
+    void clear()
+    {
+        std::vector<Entry>(1024).swap(table_);
+        mask_ = 1023;
+        size_ = 0;
+    }
+
+    // Returns the entry for the given key. If there was none, one is
+    // created with the given value and inserted is set to true.
+    Entry& insert(std::uint64_t const key, Value const& value, bool& inserted)
+    {
+        std::uint64_t const k = stored(key);
+        size_t i = slot(k);
+
+        while (table_[i].key != 0)
+        {
+            if (table_[i].key == k)
+            {
+                inserted = false;
+                return table_[i];
+            }
+            i = (i + 1) & mask_;
+        }
+
+        inserted = true;
+        if (2 * (size_ + 1) > table_.size())
+        {
+            grow();
+            i = slot(k);
+            while (table_[i].key != 0)
+                i = (i + 1) & mask_;
+        }
+
+        ++size_;
+        table_[i].key = k;
+        table_[i].value = value;
+        return table_[i];
+    }
+
+    Entry const* find(std::uint64_t const key) const
+    {
+        std::uint64_t const k = stored(key);
+
+        for (size_t i = slot(k); table_[i].key != 0; i = (i + 1) & mask_)
+            if (table_[i].key == k)
+                return &table_[i];
+
+        return 0;
+    }
+
+    // Calls f(entry) for every entry, in no particular order. Inserting
+    // the entries found into an empty table gives one with the same
+    // contents.
+    template<typename F>
+    void visit(F& f) const
+    {
+        for (size_t i = 0; i < table_.size(); ++i)
+            if (table_[i].key != 0)
+                f(table_[i]);
+    }
+
+private:
+    std::vector<Entry> table_;
+    size_t mask_;
+    size_t size_;
+
+    // Zero marks an empty slot, so a zero key is stored as another value.
+    static std::uint64_t stored(std::uint64_t const key)
+    {
+        return key == 0 ? 0x9e3779b97f4a7c15ull : key;
+    }
+
+    size_t slot(std::uint64_t const key) const
+    {
+        return (key ^ (key >> 32)) & mask_;
+    }
+
+    void grow()
+    {
+        std::vector<Entry> old(2 * table_.size());
+        old.swap(table_);
+        mask_ = table_.size() - 1;
+
+        for (size_t j = 0; j < old.size(); ++j)
+        {
+            if (old.at(j).key != 0)
+            {
+                size_t i = slot(old.at(j).key);
+                while (table_[i].key != 0)
+                    i = (i + 1) & mask_;
+                table_[i] = old.at(j);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,153 @@
+/** -*-c++-*-
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ *  File: Workers.hpp
+ *  Project: lambdaminer (potential ICFP 2012 contest entry)
+ *  Date: 2012-07-16
+ *
+ *  A fixed set of worker threads that process rounds of work items, with
+ *  a deque per thread and work stealing between them.
+ *
+ */
+
+#ifndef LAMBDAMINER_WORKERS_HPP
+#define LAMBDAMINER_WORKERS_HPP 1
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::size_t;
+
+// Job must provide operator()(size_t item, size_t thread).
+
+template<typename Job>
+class Workers
+{
+    struct Deque
+    {
+        std::deque<size_t> items;
+        std::mutex lock;
+    };
+
+    std::vector<std::thread> threads_;
+    std::vector<Deque*> deques_;
+    std::mutex lock_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    Job* job_;
+    size_t round_;
+    size_t busy_;
+    bool quit_;
+
+    Workers(Workers const&);
+    Workers& operator=(Workers const&);
+
+    // Takes the next item from the thread's own deque, or steals the last
+    // one from the deque of another thread.
+    bool take(size_t const self, size_t& item)
+    {
+        for (size_t k = 0; k < deques_.size(); ++k)
+        {
+            size_t const i = (self + k) % deques_.size();
+            Deque& d = *deques_.at(i);
+            std::lock_guard<std::mutex> guard(d.lock);
+
+            if (not d.items.empty())
+            {
+                if (i == self)
+                {
+                    item = d.items.front();
+                    d.items.pop_front();
+                }
+                else
+                {
+                    item = d.items.back();
+                    d.items.pop_back();
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(size_t const self)
+    {
+        size_t seen = 0;
+
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> guard(lock_);
+                while (not quit_ and round_ == seen)
+                    start_.wait(guard);
+                if (quit_)
+                    return;
+                seen = round_;
+            }
+
+            size_t item;
+            while (take(self, item))
+                (*job_)(item, self);
+
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                if (--busy_ == 0)
+                    done_.notify_one();
+            }
+        }
+    }
+
+public:
+    explicit Workers(size_t const count)
+        : job_(0),
+          round_(0),
+          busy_(0),
+          quit_(false)
+    {
+        for (size_t i = 0; i < count; ++i)
+            deques_.push_back(new Deque());
+        for (size_t i = 0; i < count; ++i)
+            threads_.push_back(std::thread(&Workers::work, this, i));
+    }
+
+    ~Workers()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            quit_ = true;
+        }
+        start_.notify_all();
+
+        for (size_t i = 0; i < threads_.size(); ++i)
+            threads_.at(i).join();
+        for (size_t i = 0; i < deques_.size(); ++i)
+            delete deques_.at(i);
+    }
+
+    size_t size() const { return threads_.size(); }
+
+    // Runs the job on items 0 to count-1 and returns when all are done.
+    // Each thread starts on its own contiguous range of items.
+    void run(Job& job, size_t const count)
+    {
+        size_t const n = threads_.size();
+        for (size_t i = 0; i < n; ++i)
+            for (size_t item = i * count / n; item < (i+1) * count / n; ++item)
+                deques_.at(i)->items.push_back(item);
+
+        std::unique_lock<std::mutex> guard(lock_);
+        job_ = &job;
+        busy_ = n;
+        ++round_;
+        start_.notify_all();
+
+        while (busy_ > 0)
+            done_.wait(guard);
+    }
+};
+
+#endif